@@ -0,0 +1,262 @@
+#include "cache_rlefont.hh"
+#include "encoder.hh"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <mutex>
+#include <cstring>
+#include "ccfixes.hh"
+
+#ifdef _WIN32
+#include <direct.h>
+#define make_directory(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define make_directory(path) mkdir(path, 0777)
+#endif
+
+namespace mcufont {
+namespace rlefont {
+
+// 64-bit FNV-1a. The entries are compared with the full glyph table before
+// they are used, so a collision only costs a cache miss.
+class Hasher
+{
+public:
+    Hasher(): m_hash(14695981039346656037ULL) {}
+
+    void Add(uint64_t value)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            m_hash ^= (value >> (i * 8)) & 0xFF;
+            m_hash *= 1099511628211ULL;
+        }
+    }
+
+    // Doubles are hashed by their bit pattern.
+    void AddDouble(double value)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        Add(bits);
+    }
+
+    uint64_t Get() const { return m_hash; }
+
+private:
+    uint64_t m_hash;
+};
+
+uint64_t get_glyph_hash(const DataFile::glyphentry_t &glyph)
+{
+    Hasher h;
+    h.Add(glyph.width);
+    h.Add(glyph.data.size());
+    for (uint8_t p : glyph.data)
+        h.Add(p);
+    return h.Get();
+}
+
+std::string get_cache_key(const DataFile &datafile, const optimize_options_t &options)
+{
+    const DataFile::fontinfo_t &info = datafile.GetFontInfo();
+    Hasher h;
+    h.Add(info.max_width);
+    h.Add(info.max_height);
+    h.Add(info.baseline_x);
+    h.Add(info.baseline_y);
+    h.Add(info.line_height);
+    h.Add(info.flags);
+
+    h.Add(datafile.GetGlyphCount());
+    for (size_t i = 0; i < datafile.GetGlyphCount(); i++)
+    {
+        const DataFile::glyphentry_t &g = datafile.GetGlyphEntry(i);
+        h.Add(get_glyph_hash(g));
+        h.Add(g.chars.size());
+        for (int c : g.chars)
+            h.Add(c);
+    }
+
+    const objective_t &objective = options.objective;
+    h.Add(options.fast);
+    h.Add(options.method);
+    h.AddDouble(objective.decode_weight);
+    h.Add(objective.max_glyph_cost);
+    h.AddDouble(objective.lookup_weight);
+    h.Add(objective.glyph_weights.size());
+    for (double w : objective.glyph_weights)
+        h.AddDouble(w);
+
+    std::ostringstream key;
+    key << std::hex << std::setw(16) << std::setfill('0') << h.Get();
+    return key.str();
+}
+
+// The glyph tables are the same if the glyphs have the same pixels, width
+// and characters, in the same order.
+static bool same_glyphs(const DataFile &a, const DataFile &b)
+{
+    if (a.GetGlyphCount() != b.GetGlyphCount())
+        return false;
+
+    for (size_t i = 0; i < a.GetGlyphCount(); i++)
+    {
+        const DataFile::glyphentry_t &ga = a.GetGlyphEntry(i);
+        const DataFile::glyphentry_t &gb = b.GetGlyphEntry(i);
+        if (ga.data != gb.data || ga.chars != gb.chars || ga.width != gb.width)
+            return false;
+    }
+
+    return true;
+}
+
+static std::vector<uint64_t> get_glyph_hashes(const DataFile &datafile)
+{
+    std::vector<uint64_t> result;
+    for (size_t i = 0; i < datafile.GetGlyphCount(); i++)
+        result.push_back(get_glyph_hash(datafile.GetGlyphEntry(i)));
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+DictionaryCache::DictionaryCache(const std::string &directory):
+    m_directory(directory)
+{
+}
+
+std::vector<DictionaryCache::index_entry_t> DictionaryCache::LoadIndex() const
+{
+    std::vector<index_entry_t> result;
+    std::ifstream file(m_directory + "/index");
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream input(line);
+        std::string tag;
+        index_entry_t e;
+
+        input >> tag >> e.key >> e.iterations >> e.max_width >> e.max_height;
+        if (tag != "Entry" || !input)
+            continue;
+
+        uint64_t hash;
+        while (input >> std::hex >> hash)
+            e.glyphs.push_back(hash);
+
+        result.push_back(e);
+    }
+
+    return result;
+}
+
+std::unique_ptr<DataFile> DictionaryCache::LoadEntry(const std::string &key) const
+{
+    // A damaged entry is treated as missing.
+    return encoder::read_datafile(m_directory + "/" + key + ".bdat");
+}
+
+bool DictionaryCache::Lookup(DataFile &datafile, size_t iterations,
+                             const optimize_options_t &options) const
+{
+    std::string key = get_cache_key(datafile, options);
+    for (const index_entry_t &e : LoadIndex())
+    {
+        if (e.key != key || e.iterations < iterations)
+            continue;
+
+        std::unique_ptr<DataFile> cached = LoadEntry(key);
+        if (!cached || !same_glyphs(*cached, datafile))
+            return false;
+
+        for (size_t i = 0; i < DataFile::dictionarysize; i++)
+            datafile.SetDictionaryEntry(i, cached->GetDictionaryEntry(i));
+        datafile.SetSeed(cached->GetSeed());
+        return true;
+    }
+
+    return false;
+}
+
+std::string DictionaryCache::WarmStart(DataFile &datafile) const
+{
+    const DataFile::fontinfo_t &info = datafile.GetFontInfo();
+    std::vector<uint64_t> glyphs = get_glyph_hashes(datafile);
+
+    // Closeness is the share of glyphs in common, out of all the different
+    // glyphs in the two fonts.
+    std::vector<index_entry_t> index = LoadIndex();
+    const index_entry_t *best = nullptr;
+    double best_share = 0;
+    for (const index_entry_t &e : index)
+    {
+        if (e.max_width != info.max_width || e.max_height != info.max_height)
+            continue;
+
+        std::vector<uint64_t> common;
+        std::set_intersection(glyphs.begin(), glyphs.end(),
+                              e.glyphs.begin(), e.glyphs.end(),
+                              std::back_inserter(common));
+        size_t total = glyphs.size() + e.glyphs.size() - common.size();
+        double share = (total > 0) ? (double)common.size() / total : 0;
+        if (share > best_share)
+        {
+            best = &e;
+            best_share = share;
+        }
+    }
+
+    if (!best)
+        return std::string();
+
+    std::unique_ptr<DataFile> cached = LoadEntry(best->key);
+    if (!cached)
+        return std::string();
+
+    for (size_t i = 0; i < DataFile::dictionarysize; i++)
+        datafile.SetDictionaryEntry(i, cached->GetDictionaryEntry(i));
+    return best->key;
+}
+
+// Serializes the updates of the index within the process. Separate
+// processes storing at the same time may drop each other's index lines,
+// which only costs a later cache miss.
+static std::mutex index_mutex;
+
+bool DictionaryCache::Store(const DataFile &datafile, size_t iterations,
+                            const optimize_options_t &options) const
+{
+    make_directory(m_directory.c_str());
+
+    std::string key = get_cache_key(datafile, options);
+    if (!encoder::write_datafile(m_directory + "/" + key + ".bdat", datafile))
+        return false;
+
+    std::lock_guard<std::mutex> lock(index_mutex);
+    std::ostringstream index;
+    for (const index_entry_t &e : LoadIndex())
+    {
+        if (e.key == key)
+            continue;
+
+        index << "Entry " << e.key << " " << e.iterations << " "
+              << e.max_width << " " << e.max_height << std::hex;
+        for (uint64_t hash : e.glyphs)
+            index << " " << hash;
+        index << std::dec << std::endl;
+    }
+
+    const DataFile::fontinfo_t &info = datafile.GetFontInfo();
+    index << "Entry " << key << " " << iterations << " "
+          << info.max_width << " " << info.max_height << std::hex;
+    for (uint64_t hash : get_glyph_hashes(datafile))
+        index << " " << hash;
+    index << std::dec << std::endl;
+
+    return encoder::write_file(m_directory + "/index", index.str());
+}
+
+}}
@@ -0,0 +1,142 @@
+// On-disk cache of optimized dictionaries, looked up by the contents of the
+// glyph table. Each entry is a copy of the optimized data file, stored as
+// <key>.bdat in the cache directory, and an index lists the glyphs of each
+// entry so that fonts without an entry can start from the closest one.
+
+#pragma once
+
+#include "datafile.hh"
+#include "optimize_rlefont.hh"
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace mcufont {
+namespace rlefont {
+
+// Hash of a glyph's pixels and width.
+uint64_t get_glyph_hash(const DataFile::glyphentry_t &glyph);
+
+// Key of the glyph table, the font info except for the name, and the
+// settings of the options that change what the optimizer minimizes, as a
+// hex string. The dictionary, the seed and the search settings such as the
+// thread and task counts are not included.
+std::string get_cache_key(const DataFile &datafile, const optimize_options_t &options);
+
+class DictionaryCache
+{
+public:
+    explicit DictionaryCache(const std::string &directory);
+
+    // If there is an entry for the glyphs of the datafile that has been
+    // optimized for at least the given number of iterations with the same
+    // objective, copy its dictionary and seed to the datafile and return true.
+    bool Lookup(DataFile &datafile, size_t iterations,
+                const optimize_options_t &options) const;
+
+    // Copy the dictionary of the entry with the most glyphs in common with
+    // the datafile, among those of the same glyph size. Any entry is close
+    // enough for a start, whatever objective it was optimized for. Returns the key of
+    // the entry, or an empty string if there is none.
+    std::string WarmStart(DataFile &datafile) const;
+
+    // Add or replace the entry for the datafile and the objective of the
+    // options. Returns false if it could not be written.
+    bool Store(const DataFile &datafile, size_t iterations,
+               const optimize_options_t &options) const;
+
+private:
+    struct index_entry_t
+    {
+        std::string key;
+        size_t iterations;
+        int max_width;
+        int max_height;
+        std::vector<uint64_t> glyphs; // Sorted glyph hashes
+    };
+
+    std::string m_directory;
+
+    std::vector<index_entry_t> LoadIndex() const;
+    std::unique_ptr<DataFile> LoadEntry(const std::string &key) const;
+};
+
+}}
+
+#ifdef CXXTEST_RUNNING
+#include <cxxtest/TestSuite.h>
+
+using namespace mcufont;
+using namespace mcufont::rlefont;
+
+class RLEFontCacheTests: public CxxTest::TestSuite
+{
+public:
+    void testCacheKey()
+    {
+        std::istringstream s(testfile);
+        std::unique_ptr<DataFile> f = DataFile::Load(s);
+        optimize_options_t options;
+        std::string key = get_cache_key(*f, options);
+        TS_ASSERT_EQUALS(key.size(), 16);
+
+        // The dictionary does not change the key, the glyphs do.
+        DataFile copy = *f;
+        copy.SetDictionaryEntry(0, DataFile::dictentry_t());
+        copy.SetSeed(5);
+        TS_ASSERT_EQUALS(get_cache_key(copy, options), key);
+
+        std::vector<DataFile::glyphentry_t> glyphs;
+        for (size_t i = 0; i < f->GetGlyphCount(); i++)
+            glyphs.push_back(f->GetGlyphEntry(i));
+        glyphs.at(1).data.at(2) = 15;
+        DataFile changed(f->GetDictionary(), glyphs, f->GetFontInfo());
+        TS_ASSERT_DIFFERS(get_cache_key(changed, options), key);
+        TS_ASSERT_DIFFERS(get_glyph_hash(glyphs.at(1)), get_glyph_hash(f->GetGlyphEntry(1)));
+    }
+
+    void testCacheKeyOptions()
+    {
+        std::istringstream s(testfile);
+        std::unique_ptr<DataFile> f = DataFile::Load(s);
+        optimize_options_t options;
+        std::string key = get_cache_key(*f, options);
+
+        // The search settings do not change the key.
+        optimize_options_t search = options;
+        search.threads = 3;
+        search.tasks = 7;
+        search.temperature = 10;
+        TS_ASSERT_EQUALS(get_cache_key(*f, search), key);
+
+        // Each setting of what is minimized does.
+        std::vector<optimize_options_t> changes(6, options);
+        changes.at(0).fast = true;
+        changes.at(1).method = METHOD_REPAIR;
+        changes.at(2).objective.decode_weight = 0.5;
+        changes.at(3).objective.max_glyph_cost = 40;
+        changes.at(4).objective.lookup_weight = 4;
+        changes.at(5).objective.glyph_weights = {1, 2, 0};
+        for (const optimize_options_t &c : changes)
+            TS_ASSERT_DIFFERS(get_cache_key(*f, c), key);
+
+        optimize_options_t other = changes.at(5);
+        other.objective.glyph_weights.at(2) = 1;
+        TS_ASSERT_DIFFERS(get_cache_key(*f, other), get_cache_key(*f, changes.at(5)));
+    }
+
+private:
+    static constexpr const char *testfile =
+        "Version 1\n"
+        "FontName Sans Serif\n"
+        "MaxWidth 4\n"
+        "MaxHeight 6\n"
+        "BaselineX 1\n"
+        "BaselineY 1\n"
+        "DictEntry 5 0 0F0F0\n"
+        "DictEntry 13 0 F0F0F0\n"
+        "Glyph 1,2,3 4 0F0F0F0F0F0F0F0F0F0F0F0F\n"
+        "Glyph 4 4 0F0F0F0F0F0F0F0F0F0F0F0F\n"
+        "Glyph 5 4 0F0F0F0F0F0F0F0F0F0F0F0F\n";
+};
+#endif
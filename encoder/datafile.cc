@@ -7,12 +7,23 @@
 
 #define DATAFILE_FORMAT_VERSION 1
 
+// Layout of the binary format. All values are 32-bit little endian, and
+// the offsets are from the start of the file.
+#define BINARY_MAGIC "MFDB"
+#define BINARY_FORMAT_VERSION 1
+#define BINARY_HEADER_SIZE 64   // Header, see SaveBinary() for the fields.
+#define BINARY_DICT_RECORD 16   // score, flags, pixel offset, pixel count
+#define BINARY_GLYPH_RECORD 16  // width, chars offset, char count, pixel offset
+
 namespace mcufont {
 
 DataFile::DataFile(const std::vector<dictentry_t> &dictionary,
                    const std::vector<glyphentry_t> &glyphs,
                    const fontinfo_t &fontinfo):
-    m_dictionary(dictionary), m_glyphtable(glyphs), m_fontinfo(fontinfo)
+    m_dictionary(dictionary),
+    m_glyphtable(std::make_shared<const std::vector<glyphentry_t> >(glyphs)),
+    m_fontinfo(fontinfo),
+    m_seed(0)
 {
     dictentry_t dummy = {};
     while (m_dictionary.size() < dictionarysize)
@@ -42,7 +53,7 @@ void DataFile::Save(std::ostream &file) const
         }
     }
 
-    for (const glyphentry_t &g : m_glyphtable)
+    for (const glyphentry_t &g : *m_glyphtable)
     {
         file << "Glyph ";
         for (size_t i = 0; i < g.chars.size(); i++)
@@ -54,8 +65,208 @@ void DataFile::Save(std::ostream &file) const
     }
 }
 
+static void put_u32(std::string &buf, size_t pos, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        buf[pos + i] = (char)((value >> (8 * i)) & 0xFF);
+}
+
+static uint32_t get_u32(const char *data, size_t pos)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value |= (uint32_t)(uint8_t)data[pos + i] << (8 * i);
+    return value;
+}
+
+// Pixels are packed two per byte, the first one in the low nibble.
+static void put_pixels(std::string &buf, const DataFile::pixels_t &pixels)
+{
+    for (size_t i = 0; i < pixels.size(); i += 2)
+    {
+        uint8_t b = pixels[i];
+        if (i + 1 < pixels.size())
+            b |= pixels[i + 1] << 4;
+        buf.push_back((char)b);
+    }
+}
+
+static DataFile::pixels_t get_pixels(const char *data, size_t pos, size_t count)
+{
+    DataFile::pixels_t pixels(count);
+    for (size_t i = 0; i < count; i++)
+        pixels[i] = ((uint8_t)data[pos + i / 2] >> (4 * (i % 2))) & 0x0F;
+    return pixels;
+}
+
+void DataFile::SaveBinary(std::ostream &file) const
+{
+    std::vector<const dictentry_t*> entries;
+    for (const dictentry_t &d : m_dictionary)
+    {
+        if (d.replacement.size() != 0)
+            entries.push_back(&d);
+    }
+
+    size_t dict_offset = BINARY_HEADER_SIZE;
+    size_t glyph_offset = dict_offset + entries.size() * BINARY_DICT_RECORD;
+    size_t data_offset = glyph_offset + m_glyphtable->size() * BINARY_GLYPH_RECORD;
+    std::string buf(data_offset, '\0');
+
+    // The character lists come first in the data area, so that they
+    // stay aligned.
+    for (size_t i = 0; i < m_glyphtable->size(); i++)
+    {
+        const glyphentry_t &g = m_glyphtable->at(i);
+        size_t record = glyph_offset + i * BINARY_GLYPH_RECORD;
+        put_u32(buf, record, g.width);
+        put_u32(buf, record + 4, buf.size());
+        put_u32(buf, record + 8, g.chars.size());
+
+        for (int c : g.chars)
+        {
+            buf.append(4, '\0');
+            put_u32(buf, buf.size() - 4, c);
+        }
+    }
+
+    for (size_t i = 0; i < m_glyphtable->size(); i++)
+    {
+        put_u32(buf, glyph_offset + i * BINARY_GLYPH_RECORD + 12, buf.size());
+        put_pixels(buf, m_glyphtable->at(i).data);
+    }
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        size_t record = dict_offset + i * BINARY_DICT_RECORD;
+        put_u32(buf, record, entries[i]->score);
+        put_u32(buf, record + 4, entries[i]->ref_encode ? 1 : 0);
+        put_u32(buf, record + 8, buf.size());
+        put_u32(buf, record + 12, entries[i]->replacement.size());
+        put_pixels(buf, entries[i]->replacement);
+    }
+
+    size_t name_offset = buf.size();
+    buf += m_fontinfo.name;
+
+    buf.replace(0, 4, BINARY_MAGIC);
+    put_u32(buf, 4, BINARY_FORMAT_VERSION);
+    put_u32(buf, 8, m_fontinfo.max_width);
+    put_u32(buf, 12, m_fontinfo.max_height);
+    put_u32(buf, 16, m_fontinfo.baseline_x);
+    put_u32(buf, 20, m_fontinfo.baseline_y);
+    put_u32(buf, 24, m_fontinfo.line_height);
+    put_u32(buf, 28, m_fontinfo.flags);
+    put_u32(buf, 32, m_seed);
+    put_u32(buf, 36, name_offset);
+    put_u32(buf, 40, m_fontinfo.name.size());
+    put_u32(buf, 44, entries.size());
+    put_u32(buf, 48, dict_offset);
+    put_u32(buf, 52, m_glyphtable->size());
+    put_u32(buf, 56, glyph_offset);
+    put_u32(buf, 60, buf.size());
+
+    file.write(buf.data(), buf.size());
+}
+
+std::unique_ptr<DataFile> DataFile::LoadBinary(const char *data, size_t size)
+{
+    std::unique_ptr<DataFile> invalid(nullptr);
+    if (size < BINARY_HEADER_SIZE || std::string(data, 4) != BINARY_MAGIC ||
+        get_u32(data, 4) != BINARY_FORMAT_VERSION || get_u32(data, 60) != size)
+    {
+        return invalid;
+    }
+
+    // Check that a range of the file is within the data. The arguments are
+    // 64-bit so that no count read from the file can wrap around.
+    auto fits = [&](uint64_t offset, uint64_t length) {
+        return offset <= size && length <= size - offset;
+    };
+
+    // Number of bytes taken by a run of packed 4-bit pixels.
+    auto packed = [](uint64_t count) {
+        return (count + 1) / 2;
+    };
+
+    fontinfo_t fontinfo = {};
+    fontinfo.max_width = (int32_t)get_u32(data, 8);
+    fontinfo.max_height = (int32_t)get_u32(data, 12);
+    fontinfo.baseline_x = (int32_t)get_u32(data, 16);
+    fontinfo.baseline_y = (int32_t)get_u32(data, 20);
+    fontinfo.line_height = (int32_t)get_u32(data, 24);
+    fontinfo.flags = (int32_t)get_u32(data, 28);
+
+    // Every glyph stores max_width * max_height pixels, so a size that does
+    // not fit in the file even once can be rejected before allocating.
+    if (fontinfo.max_width <= 0 || fontinfo.max_height <= 0)
+        return invalid;
+    uint64_t pixel_count = (uint64_t)fontinfo.max_width * fontinfo.max_height;
+    if (packed(pixel_count) > size)
+        return invalid;
+
+    size_t name_offset = get_u32(data, 36), name_length = get_u32(data, 40);
+    if (!fits(name_offset, name_length))
+        return invalid;
+    fontinfo.name.assign(data + name_offset, name_length);
+
+    std::vector<dictentry_t> dictionary;
+    size_t dict_count = get_u32(data, 44), dict_offset = get_u32(data, 48);
+    if (!fits(dict_offset, (uint64_t)dict_count * BINARY_DICT_RECORD))
+        return invalid;
+    for (size_t i = 0; i < dict_count && i < dictionarysize; i++)
+    {
+        size_t record = dict_offset + i * BINARY_DICT_RECORD;
+        dictentry_t d;
+        d.score = (int32_t)get_u32(data, record);
+        d.ref_encode = get_u32(data, record + 4) & 1;
+
+        size_t pixel_offset = get_u32(data, record + 8);
+        size_t entry_pixels = get_u32(data, record + 12);
+        if (!fits(pixel_offset, packed(entry_pixels)))
+            return invalid;
+        d.replacement = get_pixels(data, pixel_offset, entry_pixels);
+        dictionary.push_back(d);
+    }
+
+    std::vector<glyphentry_t> glyphtable;
+    size_t glyph_count = get_u32(data, 52), glyph_offset = get_u32(data, 56);
+    if (!fits(glyph_offset, (uint64_t)glyph_count * BINARY_GLYPH_RECORD))
+        return invalid;
+    glyphtable.resize(glyph_count);
+    for (size_t i = 0; i < glyph_count; i++)
+    {
+        size_t record = glyph_offset + i * BINARY_GLYPH_RECORD;
+        glyphentry_t &g = glyphtable[i];
+        g.width = (int32_t)get_u32(data, record);
+
+        size_t chars_offset = get_u32(data, record + 4);
+        size_t char_count = get_u32(data, record + 8);
+        if (!fits(chars_offset, (uint64_t)char_count * 4))
+            return invalid;
+        for (size_t j = 0; j < char_count; j++)
+            g.chars.push_back((int32_t)get_u32(data, chars_offset + j * 4));
+
+        size_t pixel_offset = get_u32(data, record + 12);
+        if (!fits(pixel_offset, packed(pixel_count)))
+            return invalid;
+        g.data = get_pixels(data, pixel_offset, pixel_count);
+    }
+
+    std::unique_ptr<DataFile> result(new DataFile(dictionary, glyphtable, fontinfo));
+    result->SetSeed(get_u32(data, 32));
+    return result;
+}
+
 std::unique_ptr<DataFile> DataFile::Load(std::istream &file)
 {
+    if (file.peek() == BINARY_MAGIC[0])
+    {
+        std::string data((std::istreambuf_iterator<char>(file)),
+                         std::istreambuf_iterator<char>());
+        return LoadBinary(data.data(), data.size());
+    }
+
     fontinfo_t fontinfo = {};
     std::vector<dictentry_t> dictionary;
     std::vector<glyphentry_t> glyphtable;
@@ -154,13 +365,32 @@ void DataFile::SetDictionaryEntry(size_t index, const dictentry_t &value)
     }
 }
 
+void DataFile::SetDictionaryEntry(size_t index, const dictentry_t &value,
+                                  undolog_t &undolog)
+{
+    undo_t undo = {index, m_dictionary.at(index), m_lowscoreindex};
+    undolog.push_back(undo);
+    SetDictionaryEntry(index, value);
+}
+
+void DataFile::Undo(undolog_t &undolog)
+{
+    while (undolog.size())
+    {
+        const undo_t &undo = undolog.back();
+        m_dictionary.at(undo.index) = undo.entry;
+        m_lowscoreindex = undo.lowscoreindex;
+        undolog.pop_back();
+    }
+}
+
 std::map<size_t, size_t> DataFile::GetCharToGlyphMap() const
 {
     std::map<size_t, size_t> char_to_glyph;
 
-    for (size_t i = 0; i < m_glyphtable.size(); i++)
+    for (size_t i = 0; i < m_glyphtable->size(); i++)
     {
-        for (size_t c: m_glyphtable[i].chars)
+        for (size_t c: m_glyphtable->at(i).chars)
         {
             char_to_glyph[c] = i;
         }
@@ -180,7 +410,7 @@ std::string DataFile::GlyphToText(size_t index) const
         for (int x = 0; x < m_fontinfo.max_width; x++)
         {
             size_t pos = y * m_fontinfo.max_width + x;
-            os << glyphchars[m_glyphtable.at(index).data.at(pos)];
+            os << glyphchars[m_glyphtable->at(index).data.at(pos)];
         }
         os << std::endl;
     }
@@ -1,5 +1,6 @@
 // Class to store the data of a font while it is being processed.
 // This class can be safely cloned using the default copy constructor.
+// The glyph table never changes after construction, so copies share it.
 
 #pragma once
 #include <cstdint>
@@ -55,10 +56,23 @@ public:
     // Save to a file (custom format)
     void Save(std::ostream &file) const;
 
-    // Load from a file (custom format)
-    // Returns nullptr if load fails.
+    // Load from a file (custom format, text or binary)
+    // Returns nullptr if load fails. Throws std::runtime_error if a glyph
+    // of the text format has the wrong number of pixels.
     static std::unique_ptr<DataFile> Load(std::istream &file);
 
+    // Save to a file (binary format)
+    // The file has a fixed size header and tables of fixed size records
+    // that point into a data area, with the pixels packed two per byte.
+    // Loading it still copies the whole file and unpacks every glyph.
+    void SaveBinary(std::ostream &file) const;
+
+    // Load from binary format data in memory. The pixels are unpacked into
+    // the glyph table, only the parsing of the text format is avoided.
+    // Returns nullptr if the data is not in the binary format, has the
+    // wrong version, is truncated or has sizes that do not fit in the data.
+    static std::unique_ptr<DataFile> LoadBinary(const char *data, size_t size);
+
     // Get or set an entry in the dictionary. The size of the dictionary
     // is constant. Entries 0 to 23 are reserved for special purposes.
     static const size_t dictionarysize = 256 - 24;
@@ -68,16 +82,38 @@ public:
     const std::vector<dictentry_t> &GetDictionary() const
         { return m_dictionary; }
 
+    // Log of previous dictionary states, for trying out changes in place
+    // and reverting them if they are rejected.
+    struct undo_t
+    {
+        size_t index;
+        dictentry_t entry;
+        size_t lowscoreindex;
+    };
+    typedef std::vector<undo_t> undolog_t;
+
+    // Set an entry in the dictionary and record the old state in the log.
+    void SetDictionaryEntry(size_t index, const dictentry_t &value,
+                            undolog_t &undolog);
+
+    // Revert all the changes recorded in the log, and clear it.
+    void Undo(undolog_t &undolog);
+
     // Get the index of the dictionary entry with the lowest score.
     size_t GetLowScoreIndex() const
         { return m_lowscoreindex; }
 
     // Get an entry in the glyph table.
     size_t GetGlyphCount() const
-        { return m_glyphtable.size(); }
+        { return m_glyphtable->size(); }
     const glyphentry_t &GetGlyphEntry(size_t index) const
-        { return m_glyphtable.at(index); }
+        { return m_glyphtable->at(index); }
     const std::vector<glyphentry_t> &GetGlyphTable() const
+        { return *m_glyphtable; }
+
+    // Get the glyph table as shared by the copies of this data file. Holding
+    // on to it tells apart a later table that happens to get the same address.
+    std::shared_ptr<const std::vector<glyphentry_t> > GetSharedGlyphTable() const
         { return m_glyphtable; }
 
     // Create a map of char indices to glyph indices
@@ -98,7 +134,7 @@ public:
 
 private:
     std::vector<dictentry_t> m_dictionary;
-    std::vector<glyphentry_t> m_glyphtable;
+    std::shared_ptr<const std::vector<glyphentry_t> > m_glyphtable;
     fontinfo_t m_fontinfo;
     uint32_t m_seed;
 
@@ -155,6 +191,41 @@ public:
         TS_ASSERT(f1->GetGlyphEntry(0).data == f2->GetGlyphEntry(0).data);
     }
 
+    void testBinarySave()
+    {
+        std::istringstream is1(testfile);
+        std::unique_ptr<DataFile> f1 = DataFile::Load(is1);
+
+        std::ostringstream os;
+        f1->SaveBinary(os);
+
+        std::string data = os.str();
+        std::istringstream is2(data);
+        std::unique_ptr<DataFile> f2 = DataFile::Load(is2);
+
+        TS_ASSERT_EQUALS(f1->GetFontInfo().name, f2->GetFontInfo().name);
+        TS_ASSERT_EQUALS(f1->GetFontInfo().baseline_y, f2->GetFontInfo().baseline_y);
+        TS_ASSERT_EQUALS(f1->GetDictionaryEntry(1).score, f2->GetDictionaryEntry(1).score);
+        TS_ASSERT(f1->GetDictionaryEntry(1).replacement == f2->GetDictionaryEntry(1).replacement);
+        TS_ASSERT(f1->GetGlyphEntry(0).chars == f2->GetGlyphEntry(0).chars);
+        TS_ASSERT(f1->GetGlyphEntry(2).data == f2->GetGlyphEntry(2).data);
+
+        // A cut off file is rejected, also when the size in the header has
+        // been made to match.
+        TS_ASSERT(!DataFile::LoadBinary(data.data(), data.size() - 1));
+        std::string truncated = data.substr(0, data.size() / 2);
+        truncated[60] = (char)truncated.size();
+        truncated[61] = (char)(truncated.size() >> 8);
+        TS_ASSERT(!DataFile::LoadBinary(truncated.data(), truncated.size()));
+
+        // So are glyph sizes that are negative or too large for the file.
+        std::string huge = data;
+        huge.replace(8, 8, "\xFF\xFF\xFF\xFF\x01\x00\x00\x00", 8);
+        TS_ASSERT(!DataFile::LoadBinary(huge.data(), huge.size()));
+        huge.replace(8, 8, "\xFF\xFF\x00\x00\xFF\xFF\x00\x00", 8);
+        TS_ASSERT(!DataFile::LoadBinary(huge.data(), huge.size()));
+    }
+
 private:
     static constexpr const char *testfile =
         "Version 1\n"
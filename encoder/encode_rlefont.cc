@@ -1,6 +1,12 @@
 #include "encode_rlefont.hh"
 #include <algorithm>
+#include <iterator>
+#include <array>
+#include <set>
 #include <stdexcept>
+#include <limits>
+#include <random>
+#include <cmath>
 #include "ccfixes.hh"
 
 // Number of reserved codes before the dictionary entries.
@@ -59,7 +65,7 @@ static size_t prefix_length(const DataFile::pixels_t &pixels, size_t pos)
 }
 
 // Perform the RLE encoding for a dictionary entry.
-static encoded_font_t::rlestring_t encode_rle(const DataFile::pixels_t &pixels)
+encoded_font_t::rlestring_t encode_rle(const DataFile::pixels_t &pixels)
 {
     encoded_font_t::rlestring_t result;
 
@@ -111,9 +117,30 @@ static encoded_font_t::rlestring_t encode_rle(const DataFile::pixels_t &pixels)
     return result;
 }
 
+// Get the pixels of a "fill entry" for encoding bits directly.
+static DataFile::pixels_t fillentry_pixels(size_t index)
+{
+    DataFile::pixels_t pixels;
+    size_t bitcount = fillentry_bitcount(index);
+    uint8_t byte = index - DICT_START7BIT;
+    for (size_t j = 0; j < bitcount; j++)
+    {
+        uint8_t p = (byte & (1 << j)) ? 15 : 0;
+        pixels.push_back(p);
+    }
+    return pixels;
+}
+
+// Marker for a missing node reference.
+static const uint32_t NO_NODE = 0xFFFFFFFF;
+
 // We use a tree structure to represent the dictionary entries.
 // Using this tree, we can perform a combined Aho-Corasick string matching
 // and breadth-first search to find the optimal encoding of glyph data.
+//
+// The nodes are stored in an array owned by DictTree, and refer to each
+// other by their position in it. This allows the tree to be copied, and
+// to be modified in place when a single dictionary entry changes.
 class DictTreeNode
 {
 public:
@@ -121,55 +148,26 @@ public:
         m_index(-1),
         m_ref(false),
         m_length(0),
-        m_child0(nullptr),
-        m_child15(nullptr),
-        m_suffix(nullptr)
+        m_pixel(0),
+        m_parent(NO_NODE),
+        m_child0(NO_NODE),
+        m_child15(NO_NODE),
+        m_children(NO_NODE),
+        m_child_count(0),
+        m_suffix(NO_NODE),
+        m_output(NO_NODE),
+        m_suffix_first(NO_NODE),
+        m_suffix_next(NO_NODE),
+        m_suffix_prev(NO_NODE)
         {}
 
-    void SetChild(uint8_t p, DictTreeNode *child)
-    {
-        if (p == 0)
-            m_child0 = child;
-        else if (p == 15)
-            m_child15 = child;
-        else if (p > 15)
-            throw std::logic_error("invalid pixel alpha: " + std::to_string(p));
-        else
-        {
-            if (!m_children)
-            {
-                m_children.reset(new DictTreeNode*[14]());
-            }
-            m_children[p - 1] = child;
-        }
-    }
-
-    DictTreeNode* GetChild(uint8_t p) const
-    {
-        if (p == 0)
-            return m_child0;
-        else if (p == 15)
-            return m_child15;
-        else if (p > 15)
-            throw std::logic_error("invalid pixel alpha: " + std::to_string(p));
-        else if (!m_children)
-            return nullptr;
-        else
-            return m_children[p - 1];
-    }
-
-    bool HasIntermediateChildren() const { return m_children != nullptr; }
-
     int GetIndex() const { return m_index; }
-    void SetIndex(int index) { m_index = index; }
     bool GetRef() const { return m_ref; }
-    void SetRef(bool ref) { m_ref = ref; }
     size_t GetLength() const { return m_length; }
-    void SetLength(size_t length) { m_length = length; }
-    DictTreeNode *GetSuffix() const { return m_suffix; }
-    void SetSuffix(DictTreeNode *suffix) { m_suffix = suffix; }
 
 private:
+    friend class DictTree;
+
     // Index of dictionary entry or -1 if just a intermediate node.
     int m_index;
 
@@ -179,179 +177,463 @@ private:
 
     // Length of the corresponding dictionary entry replacement.
     // Equals the distance from the tree root.
-    size_t m_length;
+    uint32_t m_length;
+
+    // The last pixel of the entry, and the node for the entry without it.
+    uint8_t m_pixel;
+    uint32_t m_parent;
 
     // Most tree nodes will only ever contains children for 0 or 15.
     // Therefore the array for other nodes is allocated only on demand.
-    DictTreeNode *m_child0;
-    DictTreeNode *m_child15;
-    std::unique_ptr<DictTreeNode*[]> m_children;
-
-    // Pointer to the longest suffix of this entry that exists in the
-    // dictionary.
-    DictTreeNode *m_suffix;
+    uint32_t m_child0;
+    uint32_t m_child15;
+    uint32_t m_children;
+    uint32_t m_child_count;
+
+    // The longest proper suffix of this entry that exists in the tree, and
+    // the longest one that is also a dictionary entry.
+    uint32_t m_suffix;
+    uint32_t m_output;
+
+    // Doubly linked list of the nodes that have this node as their suffix.
+    // Needed for repairing the suffix pointers when the tree changes.
+    uint32_t m_suffix_first;
+    uint32_t m_suffix_next;
+    uint32_t m_suffix_prev;
 };
 
-// Preallocated array for tree nodes
-class TreeAllocator
+// The dictionary entries, hardcoded entries and fill entries organized as
+// a tree. The suffix and output pointers needed by the optimal encoder are
+// maintained only if fill entries are enabled, matching encode_ref_slow().
+class DictTree
 {
 public:
-    TreeAllocator(size_t count)
-    {
-        m_storage.reset(new DictTreeNode[count]);
-        m_next = m_storage.get();
-        m_left = count;
-    }
+    DictTree(const std::vector<DataFile::dictentry_t> &dictionary, bool fast);
 
-    DictTreeNode *allocate()
-    {
-        if (m_left == 0)
-            throw std::logic_error("Ran out of preallocated entries");
+    // Replace the dictionary entry at the given position. Only the nodes
+    // affected by the change are updated.
+    void SetEntry(size_t index, const DataFile::dictentry_t &entry);
 
-        m_left--;
-        return m_next++;
-    }
+    // Number of non-empty dictionary entries. The fill entries use the codes
+    // that remain after them.
+    size_t GetEntryCount() const { return m_entry_count; }
+
+    const DictTreeNode *GetRoot() const { return &m_nodes[0]; }
+
+    const DictTreeNode *GetChild(const DictTreeNode *node, uint8_t p) const
+        { return GetNode(GetChildId(*node, p)); }
+
+    const DictTreeNode *GetSuffix(const DictTreeNode *node) const
+        { return GetNode(node->m_suffix); }
+
+    const DictTreeNode *GetOutput(const DictTreeNode *node) const
+        { return GetNode(node->m_output); }
 
 private:
-    std::unique_ptr<DictTreeNode[]> m_storage;
-    DictTreeNode *m_next;
-    size_t m_left;
+    typedef std::array<uint32_t, 14> children_t;
+
+    bool m_fast;
+    std::vector<DictTreeNode> m_nodes;
+    std::vector<children_t> m_children;
+    std::vector<uint32_t> m_free_nodes;
+    std::vector<uint32_t> m_free_children;
+
+    // Node of each dictionary entry and each fill entry, or NO_NODE.
+    std::vector<uint32_t> m_entries;
+    std::vector<bool> m_entry_refs;
+    std::vector<uint32_t> m_fills;
+    size_t m_entry_count;
+
+    const DictTreeNode *GetNode(uint32_t id) const
+        { return (id == NO_NODE) ? nullptr : &m_nodes[id]; }
+
+    uint32_t GetChildId(const DictTreeNode &node, uint8_t p) const;
+    void SetChildId(uint32_t node, uint8_t p, uint32_t child);
+
+    uint32_t AddNode(uint32_t parent, uint8_t p);
+    void RemoveNode(uint32_t id);
+    uint32_t AddPath(const DataFile::pixels_t &pixels);
+    void SetEntryNode(size_t index, uint32_t node, bool ref);
+    void SetFillNode(size_t index, uint32_t node);
+    void UpdateNode(uint32_t id);
+    void UpdateOutputs(uint32_t id);
+    void LinkSuffix(uint32_t id, uint32_t suffix);
+    void UnlinkSuffix(uint32_t id);
+    bool EndsWith(uint32_t id, uint32_t suffix) const;
 };
 
-// Add a new dictionary entry to the tree. Adds the intermediate nodes, but
-// does not yet fill the suffix pointers.
-static DictTreeNode* add_tree_entry(const DataFile::pixels_t &entry, int index,
-                                    bool ref_encoded, DictTreeNode *root,
-                                    TreeAllocator &storage)
+DictTree::DictTree(const std::vector<DataFile::dictentry_t> &dictionary,
+                   bool fast):
+    m_fast(fast),
+    m_entries(dictionary.size(), NO_NODE),
+    m_entry_refs(dictionary.size(), false),
+    m_fills(256, NO_NODE),
+    m_entry_count(0)
 {
-    DictTreeNode* node = root;
-    for (uint8_t p : entry)
+    // The root node terminates the suffix and output chains.
+    m_nodes.emplace_back();
+    m_nodes[0].m_suffix = 0;
+    m_nodes[0].m_output = 0;
+
+    // Populate the hardcoded entries for 0 to 15 alpha.
+    for (int j = 0; j < 16; j++)
+    {
+        uint32_t node = AddNode(0, j);
+        m_nodes[node].m_index = j;
+        m_nodes[node].m_ref = false;
+    }
+
+    // Populate the actual dictionary entries
+    for (size_t i = 0; i < dictionary.size(); i++)
     {
-        DictTreeNode* branch = node->GetChild(p);
-        if (!branch)
+        if (dictionary[i].replacement.size())
         {
-            branch = storage.allocate();
-            node->SetChild(p, branch);
+            SetEntryNode(i, AddPath(dictionary[i].replacement),
+                         dictionary[i].ref_encode);
         }
+    }
 
-        node = branch;
+    // Populate the fill entries for rest of dictionary
+    if (!fast)
+    {
+        for (size_t i = DICT_START + m_entry_count; i < 256; i++)
+        {
+            SetFillNode(i, AddPath(fillentry_pixels(i)));
+        }
     }
+}
+
+void DictTree::SetEntry(size_t index, const DataFile::dictentry_t &entry)
+{
+    size_t oldcount = m_entry_count;
+
+    if (m_entries.at(index) != NO_NODE)
+        SetEntryNode(index, NO_NODE, false);
+
+    if (entry.replacement.size())
+        SetEntryNode(index, AddPath(entry.replacement), entry.ref_encode);
 
-    // Replace the entry if it either does not yet have an encoding, or if
-    // the new entry is non-ref (i.e. can be used in more situations).
-    if (node->GetIndex() < 0 || (node->GetRef() && !ref_encoded))
+    // The fill entries take whatever codes the dictionary does not use.
+    if (!m_fast && m_entry_count > oldcount)
     {
-        node->SetIndex(index);
-        node->SetRef(ref_encoded);
-        node->SetLength(entry.size());
+        SetFillNode(DICT_START + oldcount, NO_NODE);
     }
+    else if (!m_fast && m_entry_count < oldcount)
+    {
+        size_t i = DICT_START + m_entry_count;
+        SetFillNode(i, AddPath(fillentry_pixels(i)));
+    }
+}
 
-    return node;
+uint32_t DictTree::GetChildId(const DictTreeNode &node, uint8_t p) const
+{
+    if (p == 0)
+        return node.m_child0;
+    else if (p == 15)
+        return node.m_child15;
+    else if (p > 15)
+        throw std::logic_error("invalid pixel alpha: " + std::to_string(p));
+    else if (node.m_children == NO_NODE)
+        return NO_NODE;
+    else
+        return m_children[node.m_children][p - 1];
 }
 
-// Walk the tree and find if the entry exists in the tree. If it does,
-// returns a pointer to it, otherwise nullptr.
-static DictTreeNode *find_tree_node(DataFile::pixels_t::const_iterator begin,
-                                    DataFile::pixels_t::const_iterator end,
-                                    DictTreeNode *root)
+void DictTree::SetChildId(uint32_t node, uint8_t p, uint32_t child)
 {
-    DictTreeNode* node = root;
-    while (begin != end)
-    {
-        uint8_t pixel = *begin++;
-        node = node->GetChild(pixel);
+    DictTreeNode &n = m_nodes[node];
 
-        if (!node)
-            return nullptr;
+    if (p == 0)
+    {
+        n.m_child0 = child;
+    }
+    else if (p == 15)
+    {
+        n.m_child15 = child;
+    }
+    else if (p > 15)
+    {
+        throw std::logic_error("invalid pixel alpha: " + std::to_string(p));
+    }
+    else
+    {
+        if (n.m_children == NO_NODE)
+        {
+            if (m_free_children.size())
+            {
+                n.m_children = m_free_children.back();
+                m_free_children.pop_back();
+            }
+            else
+            {
+                n.m_children = m_children.size();
+                m_children.emplace_back();
+            }
+            m_children[n.m_children].fill(NO_NODE);
+        }
+        m_children[n.m_children][p - 1] = child;
     }
 
-    return node;
+    if (child == NO_NODE)
+        n.m_child_count--;
+    else
+        n.m_child_count++;
 }
 
-// Fill in the suffix pointers recursively for the given subtree.
-static void fill_tree_suffixes(DictTreeNode *root, DictTreeNode *subtree,
-    const DataFile::pixels_t &entry)
+// Add a new intermediate node to the tree, and repair the suffix pointers
+// of any existing nodes whose longest suffix it now is.
+uint32_t DictTree::AddNode(uint32_t parent, uint8_t p)
 {
-    for (size_t i = 1; i < entry.size(); i++)
+    uint32_t id;
+    if (m_free_nodes.size())
+    {
+        id = m_free_nodes.back();
+        m_free_nodes.pop_back();
+        m_nodes[id] = DictTreeNode();
+    }
+    else
+    {
+        id = m_nodes.size();
+        m_nodes.emplace_back();
+    }
+
+    m_nodes[id].m_pixel = p;
+    m_nodes[id].m_parent = parent;
+    m_nodes[id].m_length = m_nodes[parent].m_length + 1;
+    SetChildId(parent, p, id);
+
+    if (m_fast)
+        return id;
+
+    // Find the longest proper suffix, using the suffixes of the parent.
+    uint32_t suffix = 0;
+    if (parent != 0)
     {
-        DictTreeNode *node = find_tree_node(entry.begin() + i, entry.end(), root);
-        if (node)
+        uint32_t s = m_nodes[parent].m_suffix;
+        while (GetChildId(m_nodes[s], p) == NO_NODE && s != 0)
+            s = m_nodes[s].m_suffix;
+
+        if (GetChildId(m_nodes[s], p) != NO_NODE)
+            suffix = GetChildId(m_nodes[s], p);
+    }
+
+    LinkSuffix(id, suffix);
+
+    const DictTreeNode &s = m_nodes[suffix];
+    m_nodes[id].m_output = (s.m_index >= 0) ? suffix : s.m_output;
+
+    // Before this node existed, every node that ends with it had the same
+    // longest suffix as it has now. Move those nodes to point to this one.
+    // The new node has no index yet, so the output pointers do not change.
+    uint32_t next;
+    for (uint32_t i = m_nodes[suffix].m_suffix_first; i != NO_NODE; i = next)
+    {
+        next = m_nodes[i].m_suffix_next;
+        if (i != id && m_nodes[i].m_length > m_nodes[id].m_length &&
+            EndsWith(i, id))
         {
-            subtree->SetSuffix(node);
-            break;
+            UnlinkSuffix(i);
+            LinkSuffix(i, id);
         }
     }
 
-    if (!subtree->GetSuffix())
-        subtree->SetSuffix(root);
+    return id;
+}
+
+// Remove a leaf node that is no longer needed for any entry.
+void DictTree::RemoveNode(uint32_t id)
+{
+    DictTreeNode &n = m_nodes[id];
 
-    DataFile::pixels_t newentry(entry);
-    newentry.resize(entry.size() + 1);
-    for (uint8_t i = 0; i < 16; i++)
+    if (!m_fast)
     {
-        // Speed-up for the common case of 0 and 15 alphas.
-        if (i == 1 && !subtree->HasIntermediateChildren())
-            i += 14;
-
-        DictTreeNode *child = subtree->GetChild(i);
-        if (child)
+        // Nodes that had this one as their longest suffix now get the next
+        // longest one. The node has no index, so output pointers stay.
+        uint32_t suffix = n.m_suffix;
+        while (n.m_suffix_first != NO_NODE)
         {
-            newentry.at(entry.size()) = i;
-            fill_tree_suffixes(root, child, newentry);
+            uint32_t i = n.m_suffix_first;
+            UnlinkSuffix(i);
+            LinkSuffix(i, suffix);
         }
+        UnlinkSuffix(id);
     }
+
+    SetChildId(n.m_parent, n.m_pixel, NO_NODE);
+
+    if (n.m_children != NO_NODE)
+        m_free_children.push_back(n.m_children);
+
+    m_free_nodes.push_back(id);
 }
 
-// Construct a lookup tree from the dictionary entries.
-static DictTreeNode* construct_tree(const std::vector<DataFile::dictentry_t> &dictionary,
-                                    TreeAllocator &storage, bool fast)
+// Add the intermediate nodes for a new entry and return its final node.
+uint32_t DictTree::AddPath(const DataFile::pixels_t &pixels)
 {
-    DictTreeNode* root = storage.allocate();
+    uint32_t node = 0;
+    for (uint8_t p : pixels)
+    {
+        uint32_t branch = GetChildId(m_nodes[node], p);
+        if (branch == NO_NODE)
+            branch = AddNode(node, p);
 
-    // Populate the hardcoded entries for 0 to 15 alpha.
-    for (int j = 0; j < 16; j++)
+        node = branch;
+    }
+    return node;
+}
+
+void DictTree::SetEntryNode(size_t index, uint32_t node, bool ref)
+{
+    uint32_t old = m_entries.at(index);
+    m_entries.at(index) = node;
+    m_entry_refs.at(index) = ref;
+
+    if (old != NO_NODE)
     {
-        DictTreeNode *node = storage.allocate();
-        node->SetIndex(j);
-        node->SetRef(false);
-        node->SetLength(1);
-        root->SetChild(j, node);
+        m_entry_count--;
+        UpdateNode(old);
     }
 
-    // Populate the actual dictionary entries
-    size_t i = DICT_START;
-    for (DataFile::dictentry_t d : dictionary)
+    if (node != NO_NODE)
+    {
+        m_entry_count++;
+        UpdateNode(node);
+    }
+}
+
+void DictTree::SetFillNode(size_t index, uint32_t node)
+{
+    uint32_t old = m_fills.at(index);
+    m_fills.at(index) = node;
+
+    if (old != NO_NODE)
+        UpdateNode(old);
+
+    if (node != NO_NODE)
+        UpdateNode(node);
+}
+
+// Select the entry that a node represents, when several entries have the
+// same replacement. Non-ref entries are preferred as they can be used in
+// more situations, and otherwise dictionary entries come before fill entries.
+// Nodes that are left without an entry are removed if they have no children.
+void DictTree::UpdateNode(uint32_t id)
+{
+    DictTreeNode &n = m_nodes[id];
+
+    if (n.m_length <= 1)
+        return; // Hardcoded entries do not change
+
+    int index = -1;
+    bool ref = false;
+
+    for (size_t i = 0; i < m_entries.size(); i++)
     {
-        if (!d.replacement.size())
+        if (m_entries[i] == id && !m_entry_refs[i])
+        {
+            index = DICT_START + i;
             break;
+        }
+    }
 
-        add_tree_entry(d.replacement, i, d.ref_encode, root, storage);
-        i++;
+    for (size_t i = 0; i < m_fills.size() && index < 0; i++)
+    {
+        if (m_fills[i] == id)
+            index = i;
     }
 
-    if (!fast)
+    for (size_t i = 0; i < m_entries.size() && index < 0; i++)
+    {
+        if (m_entries[i] == id)
+        {
+            index = DICT_START + i;
+            ref = true;
+        }
+    }
+
+    bool changed = (index >= 0) != (n.m_index >= 0);
+    n.m_index = index;
+    n.m_ref = ref;
+
+    if (changed && !m_fast)
+        UpdateOutputs(id);
+
+    // Prune the branch that is no longer needed.
+    while (id != 0 && m_nodes[id].m_index < 0 && m_nodes[id].m_child_count == 0)
+    {
+        uint32_t parent = m_nodes[id].m_parent;
+        RemoveNode(id);
+        id = parent;
+    }
+}
+
+// Recompute the output pointers of the nodes whose suffix chain passes
+// through the given node.
+void DictTree::UpdateOutputs(uint32_t id)
+{
+    std::vector<uint32_t> stack(1, id);
+    while (stack.size())
     {
-        // Populate the fill entries for rest of dictionary
-        for (; i < 256; i++)
+        const DictTreeNode &n = m_nodes[stack.back()];
+        uint32_t output = (n.m_index >= 0) ? stack.back() : n.m_output;
+        stack.pop_back();
+
+        for (uint32_t i = n.m_suffix_first; i != NO_NODE; i = m_nodes[i].m_suffix_next)
         {
-            DataFile::pixels_t pixels;
-            size_t bitcount = fillentry_bitcount(i);
-            uint8_t byte = i - DICT_START7BIT;
-            for (size_t j = 0; j < bitcount; j++)
+            if (m_nodes[i].m_output != output)
             {
-                uint8_t p = (byte & (1 << j)) ? 15 : 0;
-                pixels.push_back(p);
-            }
+                m_nodes[i].m_output = output;
 
-            add_tree_entry(pixels, i, false, root, storage);
+                if (m_nodes[i].m_index < 0)
+                    stack.push_back(i);
+            }
         }
-
-        // Fill in the suffix pointers for optimal encoding
-        DataFile::pixels_t nullentry;
-        fill_tree_suffixes(root, root, nullentry);
     }
+}
+
+void DictTree::LinkSuffix(uint32_t id, uint32_t suffix)
+{
+    DictTreeNode &n = m_nodes[id];
+    DictTreeNode &s = m_nodes[suffix];
+    n.m_suffix = suffix;
+    n.m_suffix_prev = NO_NODE;
+    n.m_suffix_next = s.m_suffix_first;
+
+    if (s.m_suffix_first != NO_NODE)
+        m_nodes[s.m_suffix_first].m_suffix_prev = id;
+
+    s.m_suffix_first = id;
+}
+
+void DictTree::UnlinkSuffix(uint32_t id)
+{
+    DictTreeNode &n = m_nodes[id];
+
+    if (n.m_suffix_prev != NO_NODE)
+        m_nodes[n.m_suffix_prev].m_suffix_next = n.m_suffix_next;
+    else
+        m_nodes[n.m_suffix].m_suffix_first = n.m_suffix_next;
+
+    if (n.m_suffix_next != NO_NODE)
+        m_nodes[n.m_suffix_next].m_suffix_prev = n.m_suffix_prev;
+
+    n.m_suffix = NO_NODE;
+    n.m_suffix_next = NO_NODE;
+    n.m_suffix_prev = NO_NODE;
+}
 
-    return root;
+// Check if the entry of node id ends with the entry of node suffix.
+bool DictTree::EndsWith(uint32_t id, uint32_t suffix) const
+{
+    while (suffix != 0)
+    {
+        if (m_nodes[id].m_pixel != m_nodes[suffix].m_pixel)
+            return false;
+
+        id = m_nodes[id].m_parent;
+        suffix = m_nodes[suffix].m_parent;
+    }
+    return true;
 }
 
 // Structure for keeping track of the shortest encoding to reach particular
@@ -372,10 +654,12 @@ struct encoding_link_t
 
 // Perform the reference encoding for a glyph entry (optimal version).
 // Uses a modified Aho-Corasick algorithm combined with breadth first search
-// to find the shortest representation.
+// to find the shortest representation. If lengths is given, it is filled
+// with the number of pixels covered by each reference.
 static encoded_font_t::refstring_t encode_ref_slow(const DataFile::pixels_t &pixels,
-                                                   const DictTreeNode *root,
-                                                   bool is_glyph)
+                                                   const DictTree &tree,
+                                                   bool is_glyph,
+                                                   std::vector<size_t> *lengths)
 {
     // Chain of encodings. Each entry in this array corresponds to a position
     // in the pixel string.
@@ -386,23 +670,24 @@ static encoded_font_t::refstring_t encode_ref_slow(const DataFile::pixels_t &pix
     chain[0].length = 0;
 
     // Read the pixels one-by-one and update the encoding links accordingly.
+    const DictTreeNode *root = tree.GetRoot();
     const DictTreeNode *node = root;
     for (size_t pos = 0; pos < pixels.size(); pos++)
     {
         uint8_t pixel = pixels.at(pos);
-        const DictTreeNode *branch = node->GetChild(pixel);
+        const DictTreeNode *branch = tree.GetChild(node, pixel);
 
         while (!branch)
         {
             // Cannot expand this sequence, defer to suffix.
-            node = node->GetSuffix();
-            branch = node->GetChild(pixel);
+            node = tree.GetSuffix(node);
+            branch = tree.GetChild(node, pixel);
         }
 
         node = branch;
 
-        // We have arrived at a new node, add it and any proper suffixes to
-        // the link chain.
+        // We have arrived at a new node, add it and any proper suffixes that
+        // are dictionary entries to the link chain.
         const DictTreeNode *suffix = node;
         while (suffix != root)
         {
@@ -416,7 +701,7 @@ static encoded_font_t::refstring_t encode_ref_slow(const DataFile::pixels_t &pix
                 if (link.length < chain[pos + 1].length)
                     chain[pos + 1] = link;
             }
-            suffix = suffix->GetSuffix();
+            suffix = tree.GetOutput(suffix);
         }
     }
 
@@ -444,19 +729,84 @@ static encoded_font_t::refstring_t encode_ref_slow(const DataFile::pixels_t &pix
     size_t len = chain[pixels.size()].length;
     result.resize(len);
 
+    if (lengths)
+        lengths->resize(len);
+
     size_t pos = pixels.size();
     for (size_t i = len; i > 0; i--)
     {
         result.at(i - 1) = chain[pos].index;
+
+        if (lengths)
+            lengths->at(i - 1) = pos - chain[pos].previous;
+
         pos = chain[pos].previous;
     }
 
     return result;
 }
 
+// Compute the length of the encoding that encode_ref_slow() would produce,
+// without constructing it. Only the number of references needed to reach
+// each position is tracked, in a buffer that is reused between calls.
+static size_t encoded_length_slow(const DataFile::pixels_t &pixels,
+                                  const DictTree &tree,
+                                  bool is_glyph)
+{
+    static thread_local std::vector<uint32_t> chain;
+    chain.assign(pixels.size() + 1, std::numeric_limits<uint32_t>::max());
+    chain[0] = 0;
+
+    const DictTreeNode *root = tree.GetRoot();
+    const DictTreeNode *node = root;
+    for (size_t pos = 0; pos < pixels.size(); pos++)
+    {
+        uint8_t pixel = pixels[pos];
+        const DictTreeNode *branch = tree.GetChild(node, pixel);
+
+        while (!branch)
+        {
+            node = tree.GetSuffix(node);
+            branch = tree.GetChild(node, pixel);
+        }
+
+        node = branch;
+
+        uint32_t best = chain[pos + 1];
+        const DictTreeNode *suffix = node;
+        while (suffix != root)
+        {
+            if (suffix->GetIndex() >= 0 && (is_glyph || !suffix->GetRef()))
+            {
+                uint32_t length = chain[pos + 1 - suffix->GetLength()] + 1;
+                if (length < best)
+                    best = length;
+            }
+            suffix = tree.GetOutput(suffix);
+        }
+        chain[pos + 1] = best;
+    }
+
+    uint32_t result = chain[pixels.size()];
+
+    if (is_glyph)
+    {
+        for (size_t pos = pixels.size() - 1; pos > 0; pos--)
+        {
+            if (pixels[pos] != 0)
+                break;
+
+            if (chain[pos] + 1 < result)
+                result = chain[pos] + 1;
+        }
+    }
+
+    return result;
+}
+
 // Walk the tree as far as possible following the given pixel string iterator.
 // Returns number of pixels encoded, and index is set to the dictionary reference.
-static size_t walk_tree(const DictTreeNode *tree,
+static size_t walk_tree(const DictTree &tree,
                         DataFile::pixels_t::const_iterator pixels,
                         DataFile::pixels_t::const_iterator pixelsend,
                         int &index, bool is_glyph)
@@ -465,11 +815,11 @@ static size_t walk_tree(const DictTreeNode *tree,
     size_t length = 0;
     index = -1;
 
-    const DictTreeNode* node = tree;
+    const DictTreeNode* node = tree.GetRoot();
     while (pixels != pixelsend)
     {
         uint8_t pixel = *pixels++;
-        node = node->GetChild(pixel);
+        node = tree.GetChild(node, pixel);
 
         if (!node)
             break;
@@ -495,8 +845,9 @@ static size_t walk_tree(const DictTreeNode *tree,
 // Perform the reference encoding for a glyph entry (fast version).
 // Uses a simple greedy search to find select the encodings.
 static encoded_font_t::refstring_t encode_ref_fast(const DataFile::pixels_t &pixels,
-                                                   const DictTreeNode *tree,
-                                                   bool is_glyph)
+                                                   const DictTree &tree,
+                                                   bool is_glyph,
+                                                   std::vector<size_t> *lengths)
 {
     encoded_font_t::refstring_t result;
 
@@ -508,28 +859,52 @@ static encoded_font_t::refstring_t encode_ref_fast(const DataFile::pixels_t &pix
         while (end > 0 && pixels.at(end - 1) == 0) end--;
     }
 
+    if (lengths)
+        lengths->clear();
+
     size_t i = 0;
     while (i < end)
     {
         int index;
-        i += walk_tree(tree, pixels.begin() + i, pixels.end(), index, is_glyph);
+        size_t length = walk_tree(tree, pixels.begin() + i, pixels.end(), index, is_glyph);
+        i += length;
         result.push_back(index);
+
+        if (lengths)
+            lengths->push_back(length);
     }
 
     if (i < pixels.size())
+    {
         result.push_back(REF_FILLZEROS);
 
+        if (lengths)
+            lengths->push_back(pixels.size() - i);
+    }
+
     return result;
 }
 
 static encoded_font_t::refstring_t encode_ref(const DataFile::pixels_t &pixels,
-                                              const DictTreeNode *tree,
-                                              bool is_glyph, bool fast)
+                                              const DictTree &tree,
+                                              bool is_glyph, bool fast,
+                                              std::vector<size_t> *lengths = nullptr)
+{
+    if (fast)
+        return encode_ref_fast(pixels, tree, is_glyph, lengths);
+    else
+        return encode_ref_slow(pixels, tree, is_glyph, lengths);
+}
+
+// Compute the length of the result of encode_ref().
+static size_t encoded_length(const DataFile::pixels_t &pixels,
+                             const DictTree &tree,
+                             bool is_glyph, bool fast)
 {
     if (fast)
-        return encode_ref_fast(pixels, tree, is_glyph);
+        return encode_ref_fast(pixels, tree, is_glyph, nullptr).size();
     else
-        return encode_ref_slow(pixels, tree, is_glyph);
+        return encoded_length_slow(pixels, tree, is_glyph);
 }
 
 // Compare dictionary entries by their coding type.
@@ -547,31 +922,24 @@ static bool cmp_dict_coding(const DataFile::dictentry_t &a,
         return false;
 }
 
-size_t estimate_tree_node_count(const std::vector<DataFile::dictentry_t> &dict)
+// Sort the dictionary so that RLE-coded entries come first.
+// This way the two are easy to distinguish based on index.
+static std::vector<DataFile::dictentry_t> sort_dictionary(const DataFile &datafile)
 {
-    size_t count = DICT_START; // Preallocated entries
-    for (const DataFile::dictentry_t &d: dict)
-    {
-        count += d.replacement.size();
-    }
-    count += 128 * 7; // Fill entries
-    return count;
+    std::vector<DataFile::dictentry_t> sorted_dict = datafile.GetDictionary();
+    std::stable_sort(sorted_dict.begin(), sorted_dict.end(), cmp_dict_coding);
+    return sorted_dict;
 }
 
 std::unique_ptr<encoded_font_t> encode_font(const DataFile &datafile,
-                                            bool fast)
+                                            bool fast, ThreadPool &pool)
 {
     std::unique_ptr<encoded_font_t> result(new encoded_font_t);
 
-    // Sort the dictionary so that RLE-coded entries come first.
-    // This way the two are easy to distinguish based on index.
-    std::vector<DataFile::dictentry_t> sorted_dict = datafile.GetDictionary();
-    std::stable_sort(sorted_dict.begin(), sorted_dict.end(), cmp_dict_coding);
+    std::vector<DataFile::dictentry_t> sorted_dict = sort_dictionary(datafile);
 
     // Build the binary tree for looking up references.
-    size_t count = estimate_tree_node_count(sorted_dict);
-    TreeAllocator allocator(count);
-    DictTreeNode* tree = construct_tree(sorted_dict, allocator, fast);
+    DictTree tree(sorted_dict, fast);
 
     // Encode the dictionary entries, using either RLE or reference method.
     for (const DataFile::dictentry_t &d : sorted_dict)
@@ -590,17 +958,17 @@ std::unique_ptr<encoded_font_t> encode_font(const DataFile &datafile,
         }
     }
 
-    // Then reference-encode the glyphs
-    for (const DataFile::glyphentry_t &g : datafile.GetGlyphTable())
-    {
-        result->glyphs.push_back(encode_ref(g.data, tree, true, fast));
-    }
+    // Then reference-encode the glyphs. The tree is only read from here on,
+    // so each glyph can be encoded into its own slot in parallel.
+    result->glyphs.resize(datafile.GetGlyphCount());
+    pool.Run(datafile.GetGlyphCount(), [&](size_t i) {
+        result->glyphs.at(i) = encode_ref(datafile.GetGlyphEntry(i).data, tree, true, fast);
+    });
 
     // Optionally verify that the encoding was correct.
     if (!fast)
     {
-        for (size_t i = 0; i < datafile.GetGlyphCount(); i++)
-        {
+        pool.Run(datafile.GetGlyphCount(), [&](size_t i) {
             std::unique_ptr<DataFile::pixels_t> decoded =
                 decode_glyph(*result, i, datafile.GetFontInfo());
             if (*decoded != datafile.GetGlyphEntry(i).data)
@@ -611,15 +979,62 @@ std::unique_ptr<encoded_font_t> encode_font(const DataFile &datafile,
                 throw std::logic_error("verification of glyph " + std::to_string(i) +
                     " failed at position " + std::to_string(pos));
             }
-        }
+        });
     }
 
     return result;
 }
 
-size_t get_encoded_size(const encoded_font_t &encoded)
+std::unique_ptr<encoded_font_t> encode_font(const DataFile &datafile,
+                                            bool fast)
+{
+    ThreadPool serial(1);
+    return encode_font(datafile, fast, serial);
+}
+
+std::vector<char_range_t> get_char_ranges(const DataFile &datafile,
+                                          const std::vector<size_t> &glyph_sizes,
+                                          size_t maximum_size, double lookup_weight)
+{
+    auto get_glyph_size = [&glyph_sizes](size_t i)
+    {
+        return glyph_sizes.at(i);
+    };
+
+    char_range_costs_t costs;
+    costs.range_size = RLEFONT_CHAR_RANGE_SIZE;
+    costs.char_size = 2;    // Offset
+    costs.missing_size = 1; // Width of the empty glyph
+    costs.shared_glyphs = true;
+    costs.lookup_weight = lookup_weight;
+    return compute_char_ranges(datafile, get_glyph_size, maximum_size, costs);
+}
+
+size_t get_char_ranges_size(const std::vector<char_range_t> &ranges,
+                            const std::vector<size_t> &glyph_sizes)
 {
     size_t total = 0;
+    for (const char_range_t &range : ranges)
+    {
+        std::set<int> stored(range.glyph_indices.begin(), range.glyph_indices.end());
+        for (int i : stored)
+        {
+            if (i >= 0)
+                total += glyph_sizes.at(i);
+            else
+                total += 1; // Width of the empty glyph
+        }
+
+        total += 2 * range.glyph_indices.size(); // Offset table
+        total += RLEFONT_CHAR_RANGE_SIZE;
+    }
+    return total;
+}
+
+size_t get_encoded_size(const DataFile &datafile, const encoded_font_t &encoded,
+                        double lookup_weight)
+{
+    size_t total = 2; // End of the dictionary offset table
     for (const encoded_font_t::rlestring_t &r : encoded.rle_dictionary)
     {
         total += r.size();
@@ -634,13 +1049,934 @@ size_t get_encoded_size(const encoded_font_t &encoded)
         if (r.size() != 0)
             total += 2; // Offset table entry
     }
+
+    std::vector<size_t> glyph_sizes;
     for (const encoded_font_t::refstring_t &r : encoded.glyphs)
+        glyph_sizes.push_back(r.size() + 1); // Width
+
+    std::vector<char_range_t> ranges = get_char_ranges(datafile, glyph_sizes,
+        RLEFONT_MAX_RANGE_DATA, lookup_weight);
+    return total + get_char_ranges_size(ranges, glyph_sizes);
+}
+
+// Knuth-Morris-Pratt search for a pixel string. Used instead of std::search
+// because the glyph data has long runs of equal pixels that make a naive
+// search slow.
+class SubstringSearch
+{
+public:
+    SubstringSearch(const DataFile::pixels_t &pattern):
+        m_pattern(pattern), m_border(pattern.size(), 0)
     {
-        total += r.size();
-        total += 2; // Offset table entry
-        total += 1; // Width table entry
+        // Length of the longest proper prefix that is also a suffix of
+        // pattern[0...i].
+        for (size_t i = 1, k = 0; i < m_pattern.size(); i++)
+        {
+            while (k > 0 && m_pattern[i] != m_pattern[k])
+                k = m_border[k - 1];
+
+            if (m_pattern[i] == m_pattern[k])
+                k++;
+
+            m_border[i] = k;
+        }
     }
-    return total;
+
+    // Check if the pattern occurs in data. Empty pattern never matches.
+    bool FindIn(const DataFile::pixels_t &data) const
+    {
+        if (m_pattern.size() == 0)
+            return false;
+
+        size_t k = 0;
+        for (uint8_t p : data)
+        {
+            while (k > 0 && p != m_pattern[k])
+                k = m_border[k - 1];
+
+            if (p == m_pattern[k])
+                k++;
+
+            if (k == m_pattern.size())
+                return true;
+        }
+
+        return false;
+    }
+
+private:
+    const DataFile::pixels_t &m_pattern;
+    std::vector<size_t> m_border;
+};
+
+// Find the glyphs whose data contains the given pixel string.
+static std::vector<size_t> find_users(const DataFile &datafile,
+                                      const DataFile::pixels_t &pixels)
+{
+    std::vector<size_t> result;
+    SubstringSearch search(pixels);
+
+    for (size_t i = 0; i < datafile.GetGlyphCount(); i++)
+    {
+        if (search.FindIn(datafile.GetGlyphEntry(i).data))
+            result.push_back(i);
+    }
+
+    return result;
+}
+
+// Same as above, but only looking at the given glyphs.
+static std::vector<size_t> find_users(const DataFile &datafile,
+                                      const DataFile::pixels_t &pixels,
+                                      const std::vector<size_t> &glyphs)
+{
+    std::vector<size_t> result;
+    SubstringSearch search(pixels);
+
+    for (size_t i : glyphs)
+    {
+        if (search.FindIn(datafile.GetGlyphEntry(i).data))
+            result.push_back(i);
+    }
+
+    return result;
+}
+
+// Size of an encoded dictionary entry, including the offset table.
+static size_t get_entry_size(const DataFile::dictentry_t &d,
+                             const DictTree &tree, bool fast)
+{
+    if (d.replacement.size() == 0)
+        return 0;
+    else if (d.ref_encode)
+        return encoded_length(d.replacement, tree, false, fast) + 2;
+    else
+        return encode_rle(d.replacement).size() + 2;
+}
+
+// Size of a single encoded glyph, including the width. The offsets are
+// counted with the character ranges.
+static size_t get_glyph_size(const DataFile::pixels_t &pixels,
+                             const DictTree &tree, bool fast)
+{
+    return encoded_length(pixels, tree, true, fast) + 1;
+}
+
+size_t decode_cost_t::GetTotal() const
+{
+    return bytes + DECODE_CALLBACK_COST * callbacks;
+}
+
+decode_cost_t get_decode_cost(const encoded_font_t &encoded, size_t index,
+                              const DataFile::fontinfo_t &fontinfo)
+{
+    decode_cost_t cost;
+    size_t width = fontinfo.max_width;
+    size_t end = fontinfo.max_width * fontinfo.max_height;
+    size_t pos = 0;
+    size_t rle_count = encoded.rle_dictionary.size();
+    size_t ref_count = encoded.ref_dictionary.size();
+
+    // Runs that are written take one callback for each row they touch.
+    auto write_pixels = [&](size_t count, bool draw) {
+        if (draw)
+            cost.callbacks += (pos + count - 1) / width - pos / width + 1;
+        pos += count;
+    };
+
+    // Same as write_ref_codeword() in the decoder.
+    auto write_ref_codeword = [&](uint8_t code, size_t depth) {
+        cost.dispatches++;
+
+        if (code <= 15)
+        {
+            write_pixels(1, code != 0);
+        }
+        else if (code == REF_FILLZEROS)
+        {
+            pos = end;
+        }
+        else if (code < DICT_START)
+        {
+            // Reserved
+        }
+        else if (code - DICT_START < (int)rle_count)
+        {
+            const encoded_font_t::rlestring_t &rle = encoded.rle_dictionary[code - DICT_START];
+            cost.bytes += 4 + rle.size();
+            cost.depth = std::max(cost.depth, depth + 1);
+
+            for (uint8_t r : rle)
+            {
+                if ((r & RLE_CODEMASK) == RLE_ZEROS)
+                    write_pixels(r & RLE_VALMASK, false);
+                else if ((r & RLE_CODEMASK) == RLE_64ZEROS)
+                    write_pixels(((r & RLE_VALMASK) + 1) * 64, false);
+                else if ((r & RLE_CODEMASK) == RLE_ONES)
+                    write_pixels((r & RLE_VALMASK) + 1, true);
+                else
+                    write_pixels(((r & RLE_VALMASK) >> 4) + 1, true);
+            }
+        }
+        else
+        {
+            size_t bitcount = fillentry_bitcount(code);
+            uint8_t byte = code - DICT_START7BIT;
+            size_t runlen = 0;
+            while (bitcount--)
+            {
+                if (byte & 1)
+                {
+                    runlen++;
+                }
+                else
+                {
+                    if (runlen)
+                        write_pixels(runlen, true);
+                    runlen = 0;
+                    write_pixels(1, false);
+                }
+                byte >>= 1;
+            }
+
+            if (runlen)
+                write_pixels(runlen, true);
+        }
+    };
+
+    const encoded_font_t::refstring_t &glyph = encoded.glyphs.at(index);
+    cost.bytes++; // Width
+    for (size_t i = 0; i < glyph.size() && pos < end; i++)
+    {
+        uint8_t code = glyph[i];
+        size_t entry = code - DICT_START;
+        cost.bytes++;
+
+        if (code >= DICT_START && entry >= rle_count && entry < rle_count + ref_count)
+        {
+            const encoded_font_t::refstring_t &ref = encoded.ref_dictionary[entry - rle_count];
+            cost.dispatches++;
+            cost.bytes += 4 + ref.size();
+            cost.depth = std::max<size_t>(cost.depth, 1);
+
+            for (uint8_t c : ref)
+                write_ref_codeword(c, 1);
+        }
+        else
+        {
+            write_ref_codeword(code, 0);
+        }
+    }
+
+    return cost;
+}
+
+double get_decode_cost(const encoded_font_t &encoded,
+                       const DataFile::fontinfo_t &fontinfo,
+                       const std::vector<double> &glyph_weights)
+{
+    double total = 0;
+    for (size_t i = 0; i < encoded.glyphs.size(); i++)
+    {
+        double weight = glyph_weights.empty() ? 1 : glyph_weights.at(i);
+        total += weight * get_decode_cost(encoded, i, fontinfo).GetTotal();
+    }
+    return total;
+}
+
+// Penalty in bytes for each unit of decode cost above max_glyph_cost.
+#define EXCESS_PENALTY 100
+
+size_t get_objective(const DataFile &datafile, const encoded_font_t &encoded,
+                     const objective_t &objective)
+{
+    const DataFile::fontinfo_t &fontinfo = datafile.GetFontInfo();
+    double total = get_encoded_size(datafile, encoded, objective.lookup_weight);
+    if (objective.decode_weight <= 0 && objective.max_glyph_cost == 0)
+        return total;
+
+    for (size_t i = 0; i < encoded.glyphs.size(); i++)
+    {
+        size_t cost = get_decode_cost(encoded, i, fontinfo).GetTotal();
+        double weight = objective.glyph_weights.empty() ? 1 : objective.glyph_weights.at(i);
+        total += objective.decode_weight * weight * cost;
+
+        if (objective.max_glyph_cost > 0 && cost > objective.max_glyph_cost)
+            total += EXCESS_PENALTY * (double)(cost - objective.max_glyph_cost);
+    }
+
+    return (size_t)std::max(0.0, std::round(total));
+}
+
+// Number of callbacks that the decoder makes to draw pixels[start, end) of
+// a glyph with a single code. The runs of equal pixels are split the same
+// way as encode_rle() splits them, and the decoder makes one call for each
+// row that a run touches.
+static size_t count_callbacks(const DataFile::pixels_t &pixels,
+                              size_t start, size_t end, size_t width)
+{
+    size_t callbacks = 0;
+    size_t pos = start;
+    while (pos < end)
+    {
+        uint8_t pixel = pixels[pos];
+        size_t count = 1;
+        while (pos + count < end && pixels[pos + count] == pixel)
+            count++;
+
+        if (pixel != 0)
+        {
+            size_t limit = (pixel == 15) ? 64 : 4;
+            for (size_t p = pos; p < pos + count; p += limit)
+            {
+                size_t last = std::min(p + limit, pos + count) - 1;
+                callbacks += last / width - p / width + 1;
+            }
+        }
+
+        pos += count;
+    }
+
+    return callbacks;
+}
+
+// Find the dictionary entry that a code covering pixels[pos, pos + length)
+// refers to, or -1 for the pixel codes and the fill entries.
+static int find_entry(uint8_t code, const DataFile::pixels_t &pixels,
+                      size_t pos, size_t length,
+                      const std::vector<DataFile::dictentry_t> &dictionary)
+{
+    size_t index = code - DICT_START;
+    if (code < DICT_START || index >= dictionary.size())
+        return -1;
+
+    const DataFile::pixels_t &r = dictionary[index].replacement;
+    if (r.size() != length || !std::equal(r.begin(), r.end(), pixels.begin() + pos))
+        return -1;
+
+    return index;
+}
+
+// Bytes that the decoder reads to draw a dictionary entry, including the
+// code that refers to it. For a reference-encoded entry, parts is set to
+// the number of pixels covered by each of its codes, and the RLE-encoded
+// entries that it uses must already be in entry_bytes.
+static size_t get_entry_bytes(const DataFile::dictentry_t &d,
+                              const DictTree &tree, bool fast,
+                              const std::vector<DataFile::dictentry_t> &dictionary,
+                              const std::vector<size_t> &entry_bytes,
+                              std::vector<size_t> &parts)
+{
+    parts.clear();
+
+    if (d.replacement.size() == 0)
+        return 0;
+    else if (!d.ref_encode)
+        return 1 + 4 + encode_rle(d.replacement).size();
+
+    encoded_font_t::refstring_t codes = encode_ref(d.replacement, tree, false, fast, &parts);
+
+    size_t bytes = 1 + 4;
+    size_t pos = 0;
+    for (size_t i = 0; i < codes.size(); i++)
+    {
+        int entry = find_entry(codes[i], d.replacement, pos, parts[i], dictionary);
+        bytes += (entry < 0) ? 1 : entry_bytes[entry];
+        pos += parts[i];
+    }
+
+    return bytes;
+}
+
+// Total decode cost of a single glyph, the same as get_decode_cost() gives
+// for it. Also stores the size that get_glyph_size() would return.
+static size_t get_glyph_cost(const DataFile::pixels_t &pixels,
+                             const DictTree &tree, bool fast,
+                             const std::vector<DataFile::dictentry_t> &dictionary,
+                             const std::vector<size_t> &entry_bytes,
+                             const std::vector<std::vector<size_t> > &entry_parts,
+                             size_t width, size_t &size)
+{
+    std::vector<size_t> lengths;
+    encoded_font_t::refstring_t codes = encode_ref(pixels, tree, true, fast, &lengths);
+    size = codes.size() + 1;
+
+    size_t bytes = 1; // Width
+    size_t callbacks = 0;
+    size_t pos = 0;
+    for (size_t i = 0; i < codes.size(); i++)
+    {
+        int entry = find_entry(codes[i], pixels, pos, lengths[i], dictionary);
+        if (entry >= 0 && entry_parts[entry].size())
+        {
+            // Each code of a reference-encoded entry writes its own runs.
+            size_t start = pos;
+            for (size_t length : entry_parts[entry])
+            {
+                callbacks += count_callbacks(pixels, start, start + length, width);
+                start += length;
+            }
+        }
+        else
+        {
+            callbacks += count_callbacks(pixels, pos, pos + lengths[i], width);
+        }
+
+        bytes += (entry < 0) ? 1 : entry_bytes[entry];
+        pos += lengths[i];
+    }
+
+    return bytes + DECODE_CALLBACK_COST * callbacks;
+}
+
+IncrementalEvaluator::IncrementalEvaluator(const DataFile &datafile, bool fast,
+                                           const objective_t &objective):
+    m_fast(fast), m_objective(objective), m_size(0), m_cost(0), m_excess(0),
+    m_dictionary(datafile.GetDictionary())
+{
+    m_tree.reset(new DictTree(m_dictionary, fast));
+
+    for (const DataFile::dictentry_t &d : m_dictionary)
+    {
+        m_entry_sizes.push_back(get_entry_size(d, *m_tree, fast));
+        m_size += m_entry_sizes.back();
+        m_users.push_back(find_users(datafile, d.replacement));
+    }
+
+    if (HasDecodeCost())
+    {
+        // The reference-encoded entries use the RLE-encoded ones.
+        m_entry_bytes.assign(m_dictionary.size(), 0);
+        m_entry_parts.resize(m_dictionary.size());
+        for (bool ref : {false, true})
+        {
+            for (size_t i = 0; i < m_dictionary.size(); i++)
+            {
+                if (m_dictionary[i].ref_encode == ref)
+                {
+                    m_entry_bytes[i] = get_entry_bytes(m_dictionary[i], *m_tree, fast,
+                        m_dictionary, m_entry_bytes, m_entry_parts[i]);
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < datafile.GetGlyphCount(); i++)
+    {
+        const DataFile::pixels_t &pixels = datafile.GetGlyphEntry(i).data;
+        if (HasDecodeCost())
+        {
+            size_t size;
+            m_glyph_costs.push_back(get_glyph_cost(pixels, *m_tree, fast,
+                m_dictionary, m_entry_bytes, m_entry_parts,
+                datafile.GetFontInfo().max_width, size));
+            m_glyph_sizes.push_back(size);
+            m_cost += GetGlyphWeight(i) * m_glyph_costs.back();
+            m_excess += GetExcess(m_glyph_costs.back());
+        }
+        else
+        {
+            m_glyph_sizes.push_back(get_glyph_size(pixels, *m_tree, fast));
+        }
+    }
+
+    m_ranges = get_char_ranges(datafile, m_glyph_sizes, RLEFONT_MAX_RANGE_DATA,
+                               m_objective.lookup_weight);
+    m_free_ranges = get_char_ranges(datafile, m_glyph_sizes,
+                                    std::numeric_limits<size_t>::max(),
+                                    m_objective.lookup_weight);
+    IndexRanges();
+    m_size += 2; // End of the dictionary offset table
+    m_size += get_char_ranges_size(m_ranges, m_glyph_sizes);
+}
+
+IncrementalEvaluator::IncrementalEvaluator(const IncrementalEvaluator &other):
+    m_fast(other.m_fast),
+    m_objective(other.m_objective),
+    m_size(other.m_size),
+    m_cost(other.m_cost),
+    m_excess(other.m_excess),
+    m_tree(new DictTree(*other.m_tree)),
+    m_dictionary(other.m_dictionary),
+    m_entry_sizes(other.m_entry_sizes),
+    m_glyph_sizes(other.m_glyph_sizes),
+    m_glyph_costs(other.m_glyph_costs),
+    m_entry_bytes(other.m_entry_bytes),
+    m_entry_parts(other.m_entry_parts),
+    m_users(other.m_users),
+    m_ranges(other.m_ranges),
+    m_free_ranges(other.m_free_ranges),
+    m_limited(other.m_limited),
+    m_range_data(other.m_range_data),
+    m_glyph_ranges(other.m_glyph_ranges),
+    m_sample(other.m_sample),
+    m_sample_weights(other.m_sample_weights)
+{
+}
+
+IncrementalEvaluator &IncrementalEvaluator::operator=(const IncrementalEvaluator &other)
+{
+    m_fast = other.m_fast;
+    m_objective = other.m_objective;
+    m_size = other.m_size;
+    m_cost = other.m_cost;
+    m_excess = other.m_excess;
+    m_tree.reset(new DictTree(*other.m_tree));
+    m_dictionary = other.m_dictionary;
+    m_entry_sizes = other.m_entry_sizes;
+    m_glyph_sizes = other.m_glyph_sizes;
+    m_glyph_costs = other.m_glyph_costs;
+    m_entry_bytes = other.m_entry_bytes;
+    m_entry_parts = other.m_entry_parts;
+    m_users = other.m_users;
+    m_ranges = other.m_ranges;
+    m_free_ranges = other.m_free_ranges;
+    m_limited = other.m_limited;
+    m_range_data = other.m_range_data;
+    m_glyph_ranges = other.m_glyph_ranges;
+    m_sample = other.m_sample;
+    m_sample_weights = other.m_sample_weights;
+    return *this;
+}
+
+IncrementalEvaluator::~IncrementalEvaluator()
+{
+}
+
+// Check if two divisions of the characters into ranges are the same.
+static bool same_ranges(const std::vector<char_range_t> &a,
+                        const std::vector<char_range_t> &b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        if (a[i].first_char != b[i].first_char || a[i].char_count != b[i].char_count)
+            return false;
+    }
+
+    return true;
+}
+
+void IncrementalEvaluator::IndexRanges()
+{
+    m_limited = !same_ranges(m_ranges, m_free_ranges);
+    m_range_data.assign(m_ranges.size(), 0);
+    m_glyph_ranges.assign(m_glyph_sizes.size(), {});
+
+    for (size_t i = 0; i < m_ranges.size(); i++)
+    {
+        for (int glyph : m_ranges[i].glyph_indices)
+        {
+            if (glyph < 0)
+                continue;
+
+            std::vector<std::pair<size_t, size_t> > &list = m_glyph_ranges[glyph];
+            if (list.empty() || list.back().first != i)
+                list.push_back(std::make_pair(i, 0));
+            list.back().second++;
+
+            m_range_data[i] += m_glyph_sizes[glyph];
+        }
+    }
+}
+
+bool IncrementalEvaluator::KeepsRanges(const change_t &change) const
+{
+    if (m_limited)
+        return false;
+
+    std::vector<size_t> data = m_range_data;
+    for (size_t i = 0; i < change.glyphs.size(); i++)
+    {
+        // The size of a glyph with more than one character is weighed
+        // against the offsets of the characters between them.
+        size_t glyph = change.glyphs[i];
+        const std::vector<std::pair<size_t, size_t> > &ranges = m_glyph_ranges[glyph];
+        if (change.glyph_sizes[i] != m_glyph_sizes[glyph] &&
+            (ranges.size() > 1 || (ranges.size() == 1 && ranges[0].second > 1)))
+        {
+            return false;
+        }
+
+        for (const std::pair<size_t, size_t> &r : ranges)
+        {
+            data[r.first] += r.second * change.glyph_sizes[i];
+            data[r.first] -= r.second * m_glyph_sizes[glyph];
+        }
+    }
+
+    for (size_t d : data)
+    {
+        if (d > RLEFONT_MAX_RANGE_DATA)
+            return false;
+    }
+
+    return true;
+}
+
+bool IncrementalEvaluator::HasDecodeCost() const
+{
+    return m_objective.decode_weight > 0 || m_objective.max_glyph_cost > 0;
+}
+
+double IncrementalEvaluator::GetGlyphWeight(size_t index) const
+{
+    if (m_objective.glyph_weights.empty())
+        return 1;
+    else
+        return m_objective.glyph_weights.at(index);
+}
+
+double IncrementalEvaluator::GetExcess(size_t glyph_cost) const
+{
+    if (m_objective.max_glyph_cost == 0 || glyph_cost <= m_objective.max_glyph_cost)
+        return 0;
+    else
+        return glyph_cost - m_objective.max_glyph_cost;
+}
+
+size_t IncrementalEvaluator::GetObjective(double size, double cost, double excess) const
+{
+    return (size_t)std::max(0.0, std::round(size + m_objective.decode_weight * cost +
+                                            EXCESS_PENALTY * excess));
+}
+
+size_t IncrementalEvaluator::Apply(const DataFile &datafile, size_t index,
+                                   change_t &change, bool sampled)
+{
+    const DataFile::dictentry_t &entry = datafile.GetDictionaryEntry(index);
+    const DataFile::pixels_t &oldpixels = m_dictionary.at(index).replacement;
+
+    size_t oldcount = m_tree->GetEntryCount();
+    m_tree->SetEntry(index, entry);
+    size_t newcount = m_tree->GetEntryCount();
+
+    // Only strings that contain either the old or the new replacement can
+    // encode differently. If the number of entries changes, also one of the
+    // fill entries appears or disappears.
+    std::vector<DataFile::pixels_t> changed;
+    changed.push_back(oldpixels);
+    changed.push_back(entry.replacement);
+
+    if (!m_fast && oldcount != newcount)
+        changed.push_back(fillentry_pixels(DICT_START + std::min(oldcount, newcount)));
+
+    std::vector<SubstringSearch> searches(changed.begin(), changed.end());
+
+    size_t total = m_size;
+
+    change.entries.clear();
+    change.entry_sizes.clear();
+    for (size_t i = 0; i < m_dictionary.size(); i++)
+    {
+        const DataFile::dictentry_t &d = (i == index) ? entry : m_dictionary[i];
+        bool affected = (i == index);
+
+        for (size_t j = 0; j < searches.size() && !affected && d.ref_encode; j++)
+            affected = searches[j].FindIn(d.replacement);
+
+        if (affected)
+        {
+            change.entries.push_back(i);
+            change.entry_sizes.push_back(get_entry_size(d, *m_tree, m_fast));
+            total += change.entry_sizes.back();
+            total -= m_entry_sizes[i];
+        }
+    }
+
+    // When sampling, only the glyphs in the sample are looked at, and
+    // each of them stands for the glyphs of its stratum.
+    auto glyph_users = [&](const DataFile::pixels_t &pixels) {
+        if (sampled)
+            return find_users(datafile, pixels, m_sample);
+        else
+            return find_users(datafile, pixels);
+    };
+
+    change.users = glyph_users(entry.replacement);
+
+    std::vector<size_t> olduserlist;
+    const std::vector<size_t> *oldusers = &m_users.at(index);
+    if (sampled)
+    {
+        std::set_intersection(oldusers->begin(), oldusers->end(),
+                              m_sample.begin(), m_sample.end(),
+                              std::back_inserter(olduserlist));
+        oldusers = &olduserlist;
+    }
+
+    std::vector<size_t> glyphs;
+    std::set_union(oldusers->begin(), oldusers->end(),
+                   change.users.begin(), change.users.end(),
+                   std::back_inserter(glyphs));
+
+    if (changed.size() > 2)
+    {
+        std::vector<size_t> fillusers = glyph_users(changed.back());
+        change.glyphs.clear();
+        std::set_union(glyphs.begin(), glyphs.end(),
+                       fillusers.begin(), fillusers.end(),
+                       std::back_inserter(change.glyphs));
+    }
+    else
+    {
+        change.glyphs.swap(glyphs);
+    }
+
+    // The decode cost of a glyph also changes when a dictionary entry that
+    // it uses gets drawn differently.
+    bool costs = HasDecodeCost();
+    if (costs)
+    {
+        change.entry_bytes = m_entry_bytes;
+        change.entry_parts = m_entry_parts;
+        for (bool ref : {false, true})
+        {
+            for (size_t i : change.entries)
+            {
+                const DataFile::dictentry_t &d = datafile.GetDictionaryEntry(i);
+                if (d.ref_encode == ref)
+                {
+                    change.entry_bytes[i] = get_entry_bytes(d, *m_tree, m_fast,
+                        datafile.GetDictionary(), change.entry_bytes,
+                        change.entry_parts[i]);
+                }
+            }
+        }
+
+        for (size_t i : change.entries)
+        {
+            if (i == index || (change.entry_bytes[i] == m_entry_bytes[i] &&
+                               change.entry_parts[i] == m_entry_parts[i]))
+            {
+                continue;
+            }
+
+            std::vector<size_t> users;
+            if (sampled)
+            {
+                std::set_intersection(m_users[i].begin(), m_users[i].end(),
+                                      m_sample.begin(), m_sample.end(),
+                                      std::back_inserter(users));
+            }
+            else
+            {
+                users = m_users[i];
+            }
+
+            glyphs.clear();
+            std::set_union(change.glyphs.begin(), change.glyphs.end(),
+                           users.begin(), users.end(),
+                           std::back_inserter(glyphs));
+            change.glyphs.swap(glyphs);
+        }
+    }
+
+    double delta = 0;
+    double cost_delta = 0;
+    double excess_delta = 0;
+    change.glyph_sizes.clear();
+    change.glyph_costs.clear();
+    for (size_t i : change.glyphs)
+    {
+        const DataFile::pixels_t &pixels = datafile.GetGlyphEntry(i).data;
+        double weight = sampled ? m_sample_weights.at(i) : 1;
+
+        if (costs)
+        {
+            size_t size;
+            size_t cost = get_glyph_cost(pixels, *m_tree, m_fast,
+                datafile.GetDictionary(), change.entry_bytes, change.entry_parts,
+                datafile.GetFontInfo().max_width, size);
+            change.glyph_costs.push_back(cost);
+            change.glyph_sizes.push_back(size);
+
+            cost_delta += weight * GetGlyphWeight(i) *
+                ((double)cost - (double)m_glyph_costs.at(i));
+            excess_delta += weight * (GetExcess(cost) - GetExcess(m_glyph_costs.at(i)));
+        }
+        else
+        {
+            change.glyph_sizes.push_back(get_glyph_size(pixels, *m_tree, m_fast));
+        }
+
+        // The glyph is stored once in each range that has its characters.
+        delta += weight * m_glyph_ranges.at(i).size() *
+            ((double)change.glyph_sizes.back() - (double)m_glyph_sizes.at(i));
+    }
+
+    // If the glyph sizes move the limits of the character ranges, divide
+    // them again. The sampled estimate keeps the old ranges.
+    change.relayout = !sampled && !KeepsRanges(change);
+    if (change.relayout)
+    {
+        std::vector<size_t> sizes = m_glyph_sizes;
+        for (size_t i = 0; i < change.glyphs.size(); i++)
+            sizes.at(change.glyphs[i]) = change.glyph_sizes[i];
+
+        change.ranges = get_char_ranges(datafile, sizes, RLEFONT_MAX_RANGE_DATA,
+                                        m_objective.lookup_weight);
+        delta = (double)get_char_ranges_size(change.ranges, sizes) -
+                (double)get_char_ranges_size(m_ranges, m_glyph_sizes);
+    }
+
+    change.size = (size_t)std::max(0.0, std::round(total + delta));
+    change.cost = m_cost + cost_delta;
+    change.excess = m_excess + excess_delta;
+    return GetObjective(total + delta, change.cost, change.excess);
+}
+
+size_t IncrementalEvaluator::Evaluate(const DataFile &trial, size_t index)
+{
+    change_t change;
+    size_t total = Apply(trial, index, change);
+
+    // Undo the change to the tree.
+    m_tree->SetEntry(index, m_dictionary.at(index));
+    return total;
+}
+
+size_t IncrementalEvaluator::Estimate(const DataFile &trial, size_t index)
+{
+    if (m_sample.empty())
+        return Evaluate(trial, index);
+
+    change_t change;
+    size_t total = Apply(trial, index, change, true);
+    m_tree->SetEntry(index, m_dictionary.at(index));
+    return total;
+}
+
+void IncrementalEvaluator::SetSample(size_t stride, uint32_t seed)
+{
+    m_sample.clear();
+    m_sample_weights.assign(m_glyph_sizes.size(), 0);
+
+    if (stride <= 1)
+        return;
+
+    std::mt19937 rnd(seed);
+    for (size_t start = 0; start < m_glyph_sizes.size(); start += stride)
+    {
+        size_t count = std::min(stride, m_glyph_sizes.size() - start);
+        std::uniform_int_distribution<size_t> dist(0, count - 1);
+        size_t glyph = start + dist(rnd);
+        m_sample.push_back(glyph);
+        m_sample_weights.at(glyph) = count;
+    }
+}
+
+void IncrementalEvaluator::Update(const DataFile &datafile, size_t index)
+{
+    change_t change;
+    Apply(datafile, index, change);
+    m_size = change.size;
+    m_cost = change.cost;
+    m_excess = change.excess;
+    m_dictionary.at(index) = datafile.GetDictionaryEntry(index);
+    m_users.at(index).swap(change.users);
+    m_entry_bytes.swap(change.entry_bytes);
+    m_entry_parts.swap(change.entry_parts);
+
+    for (size_t i = 0; i < change.entries.size(); i++)
+        m_entry_sizes.at(change.entries[i]) = change.entry_sizes[i];
+
+    for (size_t i = 0; i < change.glyphs.size(); i++)
+        m_glyph_sizes.at(change.glyphs[i]) = change.glyph_sizes[i];
+
+    for (size_t i = 0; i < change.glyph_costs.size(); i++)
+        m_glyph_costs.at(change.glyphs[i]) = change.glyph_costs[i];
+
+    if (change.relayout)
+    {
+        m_ranges.swap(change.ranges);
+        m_free_ranges = get_char_ranges(datafile, m_glyph_sizes,
+                                        std::numeric_limits<size_t>::max(),
+                                        m_objective.lookup_weight);
+    }
+    IndexRanges();
+}
+
+std::vector<size_t> IncrementalEvaluator::GetGlyphParts(const DataFile &datafile,
+                                                        size_t index) const
+{
+    std::vector<size_t> lengths;
+    encode_ref(datafile.GetGlyphEntry(index).data, *m_tree, true, m_fast, &lengths);
+    return lengths;
+}
+
+EncodingCache::EncodingCache()
+{
+}
+
+EncodingCache::~EncodingCache()
+{
+}
+
+size_t EncodingCache::GetEncodedSize(const DataFile &datafile, bool fast)
+{
+    const std::vector<DataFile::dictentry_t> &dictionary = datafile.GetDictionary();
+
+    bool restart = (datafile.GetSharedGlyphTable() != m_glyphtable || !m_tree ||
+                    fast != m_fast || dictionary.size() != m_dictionary.size());
+    std::vector<bool> dirty(datafile.GetGlyphCount(), restart);
+
+    auto mark_dirty = [&](const std::vector<size_t> &glyphs) {
+        for (size_t i : glyphs)
+            dirty[i] = true;
+    };
+
+    if (restart)
+    {
+        m_glyphtable = datafile.GetSharedGlyphTable();
+        m_fast = fast;
+        m_tree.reset(new DictTree(dictionary, fast));
+        m_glyph_sizes.assign(datafile.GetGlyphCount(), 0);
+        m_users.clear();
+        for (const DataFile::dictentry_t &d : dictionary)
+            m_users.push_back(find_users(datafile, d.replacement));
+    }
+    else
+    {
+        for (size_t i = 0; i < dictionary.size(); i++)
+        {
+            if (dictionary[i].replacement != m_dictionary[i].replacement ||
+                dictionary[i].ref_encode != m_dictionary[i].ref_encode)
+            {
+                m_tree->SetEntry(i, dictionary[i]);
+                mark_dirty(m_users[i]);
+                m_users[i] = find_users(datafile, dictionary[i].replacement);
+                mark_dirty(m_users[i]);
+            }
+        }
+
+        // The fill entries between the old and the new entry count have
+        // come or gone. The fast encoder does not use them.
+        size_t newcount = m_tree->GetEntryCount();
+        for (size_t i = std::min(m_entry_count, newcount);
+             !fast && i < std::max(m_entry_count, newcount); i++)
+        {
+            mark_dirty(find_users(datafile, fillentry_pixels(DICT_START + i)));
+        }
+    }
+
+    m_dictionary = dictionary;
+    m_entry_count = m_tree->GetEntryCount();
+
+    size_t total = 2; // End of the dictionary offset table
+    for (const DataFile::dictentry_t &d : dictionary)
+        total += get_entry_size(d, *m_tree, fast);
+
+    for (size_t i = 0; i < datafile.GetGlyphCount(); i++)
+    {
+        if (dirty[i])
+            m_glyph_sizes[i] = get_glyph_size(datafile.GetGlyphEntry(i).data, *m_tree, fast);
+    }
+
+    std::vector<char_range_t> ranges = get_char_ranges(datafile, m_glyph_sizes);
+    return total + get_char_ranges_size(ranges, m_glyph_sizes);
 }
 
 std::unique_ptr<DataFile::pixels_t> decode_glyph(
@@ -3,6 +3,8 @@
 #pragma once
 
 #include "datafile.hh"
+#include "exporttools.hh"
+#include "threadpool.hh"
 #include <vector>
 #include <memory>
 
@@ -27,19 +29,264 @@ struct encoded_font_t
     std::vector<refstring_t> glyphs;
 };
 
-// Encode all the glyphs.
+// Encode a string of pixels as an RLE dictionary entry.
+encoded_font_t::rlestring_t encode_rle(const DataFile::pixels_t &pixels);
+
+// Encode all the glyphs, spreading the work over the threads of the pool.
+// The result does not depend on the number of threads.
+std::unique_ptr<encoded_font_t> encode_font(const DataFile &datafile,
+                                            bool fast, ThreadPool &pool);
+
+// Encode all the glyphs in the calling thread. Callers that want the work
+// spread out pass a pool of their own, so that no threads are started for
+// each call or inside the tasks of another pool.
 std::unique_ptr<encoded_font_t> encode_font(const DataFile &datafile,
                                             bool fast = true);
 
-// Sum up the total size of the encoded glyphs + dictionary.
-size_t get_encoded_size(const encoded_font_t &encoded);
+// Size of struct mf_rlefont_char_range_s on a target with 32-bit pointers.
+#define RLEFONT_CHAR_RANGE_SIZE 12
+
+// Most glyph data in one character range, limited by the 16-bit offsets.
+#define RLEFONT_MAX_RANGE_DATA 65536
+
+// Divide the characters into the ranges that export_rlefont writes out.
+// Glyph sizes are the bytes of each encoded glyph, including the width.
+std::vector<char_range_t> get_char_ranges(const DataFile &datafile,
+                                          const std::vector<size_t> &glyph_sizes,
+                                          size_t maximum_size = RLEFONT_MAX_RANGE_DATA,
+                                          double lookup_weight = DEFAULT_LOOKUP_WEIGHT);
+
+// Size of the glyph data and offset tables of the ranges, and of the
+// range table itself. A glyph is stored once in each range that uses it,
+// and each range with missing characters stores one empty glyph for them.
+size_t get_char_ranges_size(const std::vector<char_range_t> &ranges,
+                            const std::vector<size_t> &glyph_sizes);
+
+// Size of the data in the font file: the dictionary with its offset table,
+// and the character ranges. Only the font struct and its name strings are
+// left out, as they do not depend on the encoding.
+size_t get_encoded_size(const DataFile &datafile, const encoded_font_t &encoded,
+                        double lookup_weight = DEFAULT_LOOKUP_WEIGHT);
 
 inline size_t get_encoded_size(const DataFile &datafile, bool fast = true)
 {
     std::unique_ptr<encoded_font_t> e = encode_font(datafile, fast);
-    return get_encoded_size(*e);
+    return get_encoded_size(datafile, *e);
 }
 
+// Work done by the decoder in mf_rlefont.c to draw one glyph.
+struct decode_cost_t
+{
+    size_t bytes = 0;       // Bytes of font data read, excluding the lookup.
+    size_t callbacks = 0;   // Calls of the pixel callback.
+    size_t dispatches = 0;  // Codes dispatched, also inside ref entries.
+    size_t depth = 0;       // Deepest nesting of dictionary entries, 0 to 2.
+
+    // The cost that the optimizer weighs, counting each callback as
+    // DECODE_CALLBACK_COST bytes read.
+    size_t GetTotal() const;
+};
+
+// Assumed cost of a callback in bytes read. The call goes through a
+// function pointer with five arguments, which is much slower than a load.
+#define DECODE_CALLBACK_COST 4
+
+// Count the work of the decoder for a glyph by following what it does.
+decode_cost_t get_decode_cost(const encoded_font_t &encoded, size_t index,
+                              const DataFile::fontinfo_t &fontinfo);
+
+// Sum of the glyphs' total decode costs, each multiplied by its weight, or
+// by 1 if the weights are empty.
+double get_decode_cost(const encoded_font_t &encoded,
+                       const DataFile::fontinfo_t &fontinfo,
+                       const std::vector<double> &glyph_weights);
+
+inline double get_decode_cost(const DataFile &datafile,
+                              const std::vector<double> &glyph_weights,
+                              bool fast = true)
+{
+    std::unique_ptr<encoded_font_t> e = encode_font(datafile, fast);
+    return get_decode_cost(*e, datafile.GetFontInfo(), glyph_weights);
+}
+
+// What the optimizer minimizes: the encoded size plus decode_weight times
+// the weighted decode cost. If max_glyph_cost is set, each unit of total
+// decode cost that a glyph has above it adds a penalty that outweighs
+// any likely saving in size. With neither, this is the size.
+struct objective_t
+{
+    double decode_weight = 0;
+    std::vector<double> glyph_weights;
+    size_t max_glyph_cost = 0;
+
+    // Cost of a character range, as given to get_char_ranges(). Set it to
+    // the value used for the export so that the ranges are the same.
+    double lookup_weight = DEFAULT_LOOKUP_WEIGHT;
+};
+
+// Value of the objective, equal to what IncrementalEvaluator computes.
+size_t get_objective(const DataFile &datafile, const encoded_font_t &encoded,
+                     const objective_t &objective);
+
+inline size_t get_objective(const DataFile &datafile, const objective_t &objective,
+                            bool fast = true)
+{
+    std::unique_ptr<encoded_font_t> e = encode_font(datafile, fast);
+    return get_objective(datafile, *e, objective);
+}
+
+class DictTree;
+
+// Keeps track of the encoded size of each glyph, so that the effect of
+// changing a single dictionary entry can be evaluated by re-encoding only
+// the glyphs whose pixel strings contain the old or the new replacement.
+// The dictionary tree is kept between evaluations and modified in place.
+// The sizes returned are values of the objective, which is the encoded size
+// unless the objective has a decode weight.
+class IncrementalEvaluator
+{
+public:
+    IncrementalEvaluator(const DataFile &datafile, bool fast = true,
+                         const objective_t &objective = objective_t());
+    IncrementalEvaluator(const IncrementalEvaluator &other);
+    IncrementalEvaluator &operator=(const IncrementalEvaluator &other);
+    ~IncrementalEvaluator();
+
+    // Get the objective, which is the total encoded size, equal to
+    // get_encoded_size(datafile), unless there is a decode cost in it.
+    size_t GetEncodedSize() const { return GetObjective(m_size, m_cost, m_excess); }
+
+    // Get the weighted decode cost, equal to get_decode_cost(datafile,
+    // weights). Only kept track of if the objective has a decode cost.
+    double GetDecodeCost() const { return m_cost; }
+
+    // Compute the encoded size of trial, which must differ from the
+    // current state only by the dictionary entry at index.
+    size_t Evaluate(const DataFile &trial, size_t index);
+
+    // Estimate the result of Evaluate() by re-encoding only the affected
+    // glyphs that are in the sample, each standing for its whole stratum.
+    // Without a sample, this is the same as Evaluate().
+    size_t Estimate(const DataFile &trial, size_t index);
+
+    // Select the glyphs for Estimate(): one at random from each run of
+    // stride consecutive glyphs. A stride of 0 or 1 clears the sample.
+    void SetSample(size_t stride, uint32_t seed);
+    bool HasSample() const { return !m_sample.empty(); }
+
+    // Accept the change of dictionary entry at index.
+    void Update(const DataFile &datafile, size_t index);
+
+    // Encode a glyph with the current dictionary, and return the number
+    // of pixels covered by each reference.
+    std::vector<size_t> GetGlyphParts(const DataFile &datafile, size_t index) const;
+
+private:
+    // Sizes of the entries and glyphs affected by a change.
+    struct change_t
+    {
+        std::vector<size_t> users;
+        std::vector<size_t> entries;
+        std::vector<size_t> entry_sizes;
+        std::vector<size_t> glyphs;
+        std::vector<size_t> glyph_sizes;
+        std::vector<size_t> glyph_costs;
+        std::vector<size_t> entry_bytes;
+        std::vector<std::vector<size_t> > entry_parts;
+        size_t size;
+        double cost;
+        double excess;
+
+        // Set if the character ranges had to be divided again.
+        bool relayout;
+        std::vector<char_range_t> ranges;
+    };
+
+    bool m_fast;
+    objective_t m_objective;
+    size_t m_size;
+    double m_cost;
+    double m_excess;
+    std::unique_ptr<DictTree> m_tree;
+    std::vector<DataFile::dictentry_t> m_dictionary;
+    std::vector<size_t> m_entry_sizes;
+    std::vector<size_t> m_glyph_sizes;
+    std::vector<size_t> m_glyph_costs;
+
+    // For the decode cost, the bytes read to draw each dictionary entry,
+    // and for reference-encoded ones the pixels covered by each code.
+    std::vector<size_t> m_entry_bytes;
+    std::vector<std::vector<size_t> > m_entry_parts;
+
+    // For each dictionary entry, the glyphs whose data contains it.
+    std::vector<std::vector<size_t> > m_users;
+
+    // Character ranges of the font file, and how they would be divided
+    // without the limit on their size. While the two are the same and the
+    // glyph data of each range stays within the limit, the ranges do not
+    // change when the sizes of glyphs with a single character do.
+    std::vector<char_range_t> m_ranges;
+    std::vector<char_range_t> m_free_ranges;
+    bool m_limited;
+
+    // Glyph data in each range, and for each glyph the ranges that store
+    // it with the number of its characters in them.
+    std::vector<size_t> m_range_data;
+    std::vector<std::vector<std::pair<size_t, size_t> > > m_glyph_ranges;
+
+    // Glyphs in the sample, in order, and the number of glyphs that each
+    // glyph stands for (0 for the ones outside the sample).
+    std::vector<size_t> m_sample;
+    std::vector<double> m_sample_weights;
+
+    // Apply the change of entry at index to the tree, and encode the
+    // entries and glyphs affected by it. Returns the new objective, or
+    // an estimate of it when sampled is set.
+    size_t Apply(const DataFile &datafile, size_t index, change_t &change,
+                 bool sampled = false);
+
+    // Find the ranges of each glyph and the data in each range, after
+    // m_ranges or m_glyph_sizes have changed.
+    void IndexRanges();
+
+    // Check if the ranges stay the same with the glyph sizes of change.
+    bool KeepsRanges(const change_t &change) const;
+
+    bool HasDecodeCost() const;
+    double GetGlyphWeight(size_t index) const;
+    double GetExcess(size_t glyph_cost) const;
+    size_t GetObjective(double size, double cost, double excess) const;
+};
+
+// Remembers the encoded size of each glyph, and the glyphs that each
+// dictionary entry occurs in. When the size is asked for again after the
+// dictionary has changed, only the glyphs that contain a changed entry, or
+// a fill entry that came or went, are encoded again. The cache is meant for
+// one font at a time, and starts over if the glyph table or the encoder
+// changes.
+class EncodingCache
+{
+public:
+    EncodingCache();
+    ~EncodingCache();
+
+    // Same as get_encoded_size(datafile, fast).
+    size_t GetEncodedSize(const DataFile &datafile, bool fast = true);
+
+private:
+    bool m_fast = true;
+    std::shared_ptr<const std::vector<DataFile::glyphentry_t> > m_glyphtable;
+    size_t m_entry_count = 0;
+
+    // Kept up to date with the changed entries between the calls.
+    std::unique_ptr<DictTree> m_tree;
+    std::vector<DataFile::dictentry_t> m_dictionary;
+    std::vector<size_t> m_glyph_sizes;
+
+    // For each dictionary entry, the glyphs whose data contains it.
+    std::vector<std::vector<size_t> > m_users;
+};
+
 // Decode a single glyph (for verification).
 std::unique_ptr<DataFile::pixels_t> decode_glyph(
     const encoded_font_t &encoded,
@@ -107,6 +354,177 @@ public:
         }
     }
 
+    void testParallelEncode()
+    {
+        std::istringstream s(testfile);
+        std::unique_ptr<DataFile> f = DataFile::Load(s);
+
+        ThreadPool serial(1), parallel(3);
+        std::unique_ptr<encoded_font_t> e1 = encode_font(*f, false, serial);
+        std::unique_ptr<encoded_font_t> e2 = encode_font(*f, false, parallel);
+
+        TS_ASSERT(e1->glyphs == e2->glyphs);
+        TS_ASSERT(e1->ref_dictionary == e2->ref_dictionary);
+        TS_ASSERT(e1->rle_dictionary == e2->rle_dictionary);
+    }
+
+    void testIncrementalEvaluator()
+    {
+        std::istringstream s(testfile);
+        std::unique_ptr<DataFile> f = DataFile::Load(s);
+
+        for (bool fast : {true, false})
+        {
+            IncrementalEvaluator eval(*f, fast);
+            TS_ASSERT_EQUALS(eval.GetEncodedSize(), get_encoded_size(*f, fast));
+
+            DataFile trial = *f;
+            DataFile::dictentry_t d = trial.GetDictionaryEntry(1);
+            d.replacement = {0, 0, 0, 14, 14, 14};
+            trial.SetDictionaryEntry(1, d);
+
+            TS_ASSERT_EQUALS(eval.Evaluate(trial, 1), get_encoded_size(trial, fast));
+            TS_ASSERT_EQUALS(eval.GetEncodedSize(), get_encoded_size(*f, fast));
+
+            eval.Update(trial, 1);
+            TS_ASSERT_EQUALS(eval.GetEncodedSize(), get_encoded_size(trial, fast));
+
+            // Removing an entry also changes the available fill entries.
+            trial.SetDictionaryEntry(0, DataFile::dictentry_t());
+            TS_ASSERT_EQUALS(eval.Evaluate(trial, 0), get_encoded_size(trial, fast));
+        }
+    }
+
+    void testDecodeCost()
+    {
+        std::istringstream s(testfile);
+        std::unique_ptr<DataFile> f = DataFile::Load(s);
+
+        // Glyph 0 uses the reference-encoded entry three times, and it
+        // uses the first RLE-encoded entry twice.
+        std::unique_ptr<encoded_font_t> e = encode_font(*f, false);
+        decode_cost_t cost = get_decode_cost(*e, 0, f->GetFontInfo());
+        TS_ASSERT_EQUALS(cost.bytes, 1 + 3 + 3 * (4 + 2) + 6 * (4 + 4));
+        TS_ASSERT_EQUALS(cost.callbacks, 12);
+        TS_ASSERT_EQUALS(cost.dispatches, 9);
+        TS_ASSERT_EQUALS(cost.depth, 2);
+
+        objective_t objective;
+        objective.decode_weight = 1;
+        objective.glyph_weights = {2, 1, 0};
+        objective.max_glyph_cost = 60;
+
+        for (bool fast : {true, false})
+        {
+            IncrementalEvaluator eval(*f, fast, objective);
+            TS_ASSERT_EQUALS(eval.GetDecodeCost(),
+                             get_decode_cost(*f, objective.glyph_weights, fast));
+            TS_ASSERT_EQUALS(eval.GetEncodedSize(), get_objective(*f, objective, fast));
+
+            // Changing the entry that the reference-encoded one is made of
+            // changes the cost of glyph 0 even though its codes stay.
+            DataFile trial = *f;
+            DataFile::dictentry_t d = trial.GetDictionaryEntry(0);
+            d.replacement = {14, 0};
+            trial.SetDictionaryEntry(0, d);
+            TS_ASSERT_EQUALS(eval.Evaluate(trial, 0), get_objective(trial, objective, fast));
+
+            eval.Update(trial, 0);
+            TS_ASSERT_EQUALS(eval.GetDecodeCost(),
+                             get_decode_cost(trial, objective.glyph_weights, fast));
+            TS_ASSERT_EQUALS(eval.GetEncodedSize(), get_objective(trial, objective, fast));
+
+            trial.SetDictionaryEntry(3, DataFile::dictentry_t());
+            eval.Update(trial, 3);
+            TS_ASSERT_EQUALS(eval.GetEncodedSize(), get_objective(trial, objective, fast));
+        }
+    }
+
+    void testCharRanges()
+    {
+        std::istringstream s(testfile);
+        std::unique_ptr<DataFile> f = DataFile::Load(s);
+
+        // Characters 0 to 3 in one range, with an empty glyph for the
+        // missing 1, and 40 in a range of its own with a copy of glyph 1.
+        std::vector<DataFile::glyphentry_t> glyphs = f->GetGlyphTable();
+        glyphs.at(0).chars = {0};
+        glyphs.at(1).chars = {2, 40};
+        glyphs.at(2).chars = {3};
+        DataFile gapped(f->GetDictionary(), glyphs, f->GetFontInfo());
+
+        std::vector<size_t> sizes = {5, 7, 9};
+        std::vector<char_range_t> ranges = get_char_ranges(gapped, sizes);
+        TS_ASSERT_EQUALS(ranges.size(), 2);
+        TS_ASSERT_EQUALS(ranges.at(0).char_count, 4);
+        TS_ASSERT_EQUALS(ranges.at(1).first_char, 40);
+        TS_ASSERT_EQUALS(get_char_ranges_size(ranges, sizes),
+                         (5 + 7 + 9 + 1 + 2 * 4 + RLEFONT_CHAR_RANGE_SIZE) +
+                         (7 + 2 + RLEFONT_CHAR_RANGE_SIZE));
+
+        // With a high enough lookup weight, the gap is filled in.
+        ranges = get_char_ranges(gapped, sizes, RLEFONT_MAX_RANGE_DATA, 100);
+        TS_ASSERT_EQUALS(ranges.size(), 1);
+        TS_ASSERT_EQUALS(ranges.at(0).char_count, 41);
+
+        // The size limit splits the first range before character 3.
+        ranges = get_char_ranges(gapped, sizes, 12);
+        TS_ASSERT_EQUALS(ranges.size(), 3);
+        TS_ASSERT_EQUALS(ranges.at(1).first_char, 3);
+
+        // Characters above 0xFFFF are left out, and reported.
+        glyphs.at(2).chars = {3, 0x1F600};
+        DataFile wide(f->GetDictionary(), glyphs, f->GetFontInfo());
+        ranges = get_char_ranges(wide, sizes);
+        TS_ASSERT_EQUALS(ranges.size(), 2);
+        TS_ASSERT_EQUALS(ranges.at(1).first_char, 40);
+        TS_ASSERT_EQUALS(get_dropped_chars(wide), std::vector<int>{0x1F600});
+        TS_ASSERT(get_dropped_chars(gapped).empty());
+
+        for (bool fast : {true, false})
+        {
+            IncrementalEvaluator eval(gapped, fast);
+            TS_ASSERT_EQUALS(eval.GetEncodedSize(), get_encoded_size(gapped, fast));
+
+            DataFile trial = gapped;
+            DataFile::dictentry_t d = trial.GetDictionaryEntry(1);
+            d.replacement = {0, 0, 0, 14, 14, 14};
+            trial.SetDictionaryEntry(1, d);
+            TS_ASSERT_EQUALS(eval.Evaluate(trial, 1), get_encoded_size(trial, fast));
+        }
+    }
+
+    void testEncodingCache()
+    {
+        std::istringstream s(testfile);
+        std::unique_ptr<DataFile> f = DataFile::Load(s);
+
+        for (bool fast : {true, false})
+        {
+            EncodingCache cache;
+            TS_ASSERT_EQUALS(cache.GetEncodedSize(*f, fast), get_encoded_size(*f, fast));
+
+            DataFile::dictentry_t d = f->GetDictionaryEntry(1);
+            d.replacement = {0, 0, 0, 14, 14, 14};
+            f->SetDictionaryEntry(1, d);
+            TS_ASSERT_EQUALS(cache.GetEncodedSize(*f, fast), get_encoded_size(*f, fast));
+
+            f->SetDictionaryEntry(0, DataFile::dictentry_t());
+            TS_ASSERT_EQUALS(cache.GetEncodedSize(*f, fast), get_encoded_size(*f, fast));
+
+            d = f->GetDictionaryEntry(3);
+            d.ref_encode = false;
+            f->SetDictionaryEntry(3, d);
+            TS_ASSERT_EQUALS(cache.GetEncodedSize(*f, fast), get_encoded_size(*f, fast));
+
+            // A new glyph table starts over.
+            std::vector<DataFile::glyphentry_t> glyphs = f->GetGlyphTable();
+            glyphs.at(1).data.assign(glyphs.at(1).data.size(), 14);
+            f.reset(new DataFile(f->GetDictionary(), glyphs, f->GetFontInfo()));
+            TS_ASSERT_EQUALS(cache.GetEncodedSize(*f, fast), get_encoded_size(*f, fast));
+        }
+    }
+
 private:
     static constexpr const char *testfile =
         "Version 1\n"
@@ -0,0 +1,458 @@
+#include "encoder.hh"
+#include "importtools.hh"
+#include "bdf_import.hh"
+#include "freetype_import.hh"
+#include "encode_rlefont.hh"
+#include "export_rlefont.hh"
+#include "export_bwfont.hh"
+#include "threadpool.hh"
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include "ccfixes.hh"
+#include "gb2312_in_ucs2.h"
+
+namespace mcufont {
+namespace encoder {
+
+std::unique_ptr<DataFile> import_freetype(const std::string &data, int size, bool bw)
+{
+    std::istringstream input(data);
+    return LoadFreetype(input, size, bw);
+}
+
+std::unique_ptr<DataFile> import_bdf(const std::string &data)
+{
+    std::istringstream input(data);
+    return LoadBDF(input);
+}
+
+std::unique_ptr<DataFile> load_datafile(const std::string &data)
+{
+    std::istringstream input(data);
+    try
+    {
+        return DataFile::Load(input);
+    }
+    catch (const std::runtime_error &)
+    {
+        return nullptr;
+    }
+}
+
+std::string save_datafile(const DataFile &datafile, bool binary)
+{
+    std::ostringstream output;
+    if (binary)
+        datafile.SaveBinary(output);
+    else
+        datafile.Save(output);
+    return output.str();
+}
+
+bool write_file(const std::string &filename, const std::string &data)
+{
+    std::string tmp = filename + ".tmp";
+
+    {
+        std::ofstream outfile(tmp, std::ios::binary);
+        outfile << data;
+        outfile.close();
+        if (!outfile.good())
+            return false;
+    }
+
+    // Windows does not replace an existing file on rename, so there it is
+    // removed first.
+    if (std::rename(tmp.c_str(), filename.c_str()) != 0)
+    {
+        std::remove(filename.c_str());
+        if (std::rename(tmp.c_str(), filename.c_str()) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+// Data files named *.bdat are saved in the binary format. Both formats
+// are recognized when loading.
+static bool is_binary_dat(const std::string &filename)
+{
+    const std::string ext = ".bdat";
+    return filename.size() >= ext.size() &&
+           filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+std::unique_ptr<DataFile> read_datafile(const std::string &filename)
+{
+    std::ifstream infile(filename, std::ios::binary);
+    if (!infile.good())
+        return nullptr;
+
+    std::ostringstream data;
+    data << infile.rdbuf();
+    return load_datafile(data.str());
+}
+
+bool write_datafile(const std::string &filename, const DataFile &datafile)
+{
+    bool binary = is_binary_dat(filename);
+    return write_file(filename, save_datafile(datafile, binary));
+}
+
+std::set<int> parse_char_set(const std::vector<std::string> &items)
+{
+    std::set<int> allowed;
+
+    for (const std::string &s : items)
+    {
+        size_t pos = s.find('-');
+        if (pos == std::string::npos)
+        {
+            if(s == "gb2312") {
+                allowed.insert(
+                    &gb2312_in_ucs2_codetable[0],
+                    &gb2312_in_ucs2_codetable[sizeof(gb2312_in_ucs2_codetable)/sizeof(gb2312_in_ucs2_codetable[0])]);
+            } else {
+                // Single char
+                allowed.insert(std::stoi(s, nullptr, 0));
+            }
+        }
+        else
+        {
+            // Range
+            int start = std::stoi(s.substr(0, pos), nullptr, 0);
+            int end = std::stoi(s.substr(pos + 1), nullptr, 0);
+
+            for (int j = start; j <= end; j++)
+            {
+                allowed.insert(j);
+            }
+        }
+    }
+
+    return allowed;
+}
+
+std::unique_ptr<DataFile> filter(const DataFile &datafile, const std::set<int> &allowed)
+{
+    std::vector<DataFile::glyphentry_t> newglyphs;
+    for (size_t i = 0; i < datafile.GetGlyphCount(); i++)
+    {
+        DataFile::glyphentry_t g = datafile.GetGlyphEntry(i);
+
+        for (size_t j = 0; j < g.chars.size(); j++)
+        {
+            if (!allowed.count(g.chars.at(j)))
+            {
+                g.chars.erase(g.chars.begin() + j);
+                j--;
+            }
+        }
+
+        if (g.chars.size())
+        {
+            newglyphs.push_back(g);
+        }
+    }
+
+    DataFile::fontinfo_t fontinfo = datafile.GetFontInfo();
+    crop_glyphs(newglyphs, fontinfo);
+    detect_flags(newglyphs, fontinfo);
+
+    return std::unique_ptr<DataFile>(new DataFile(datafile.GetDictionary(), newglyphs, fontinfo));
+}
+
+void optimize(DataFile &datafile, size_t iterations,
+              const rlefont::optimize_options_t &options,
+              rlefont::optimize_state_t *state)
+{
+    rlefont::optimize_state_t local_state;
+    if (!state)
+        state = &local_state;
+
+    for (size_t i = 0; i < iterations; i++)
+        rlefont::optimize(datafile, options, state);
+}
+
+size_t encoded_size(const DataFile &datafile)
+{
+    return rlefont::get_encoded_size(datafile, false);
+}
+
+std::string export_rlefont(const DataFile &datafile, const std::string &name,
+                           double lookup_weight)
+{
+    std::ostringstream output;
+    rlefont::write_source(output, name, datafile, lookup_weight);
+    return output.str();
+}
+
+std::string export_bwfont(const DataFile &datafile, const std::string &name,
+                          double lookup_weight)
+{
+    std::ostringstream output;
+    bwfont::write_source(output, name, datafile, lookup_weight);
+    return output.str();
+}
+
+std::string warm_start(const rlefont::DictionaryCache &dictcache,
+                       DataFile &datafile, bool fast)
+{
+    DataFile trial = datafile;
+    std::string key = dictcache.WarmStart(trial);
+    if (key.empty() ||
+        rlefont::get_encoded_size(trial, fast) >= rlefont::get_encoded_size(datafile, fast))
+    {
+        return std::string();
+    }
+
+    datafile = trial;
+    return key;
+}
+
+std::vector<build_font_t> load_build_spec(std::istream &file)
+{
+    std::vector<build_font_t> fonts;
+    std::string line;
+    int lineno = 0;
+    while (std::getline(file, line))
+    {
+        lineno++;
+        std::istringstream input(line);
+        std::string tag, value;
+        std::vector<std::string> values;
+
+        if (!(input >> tag) || tag.at(0) == '#')
+            continue;
+
+        while (input >> value)
+            values.push_back(value);
+
+        if (tag != "Font" && fonts.empty())
+        {
+            throw std::runtime_error("Line " + std::to_string(lineno) +
+                                     ": expected Font");
+        }
+
+        size_t count = (tag == "Size") ? 2 : (tag == "Chars") ? values.size() : 1;
+        if (values.empty() || values.size() > count)
+        {
+            throw std::runtime_error("Line " + std::to_string(lineno) +
+                                     ": invalid value for " + tag);
+        }
+
+        if (tag == "Font")
+        {
+            fonts.push_back(build_font_t());
+            fonts.back().name = values.at(0);
+        }
+        else if (tag == "Source")
+        {
+            fonts.back().source = values.at(0);
+        }
+        else if (tag == "Size")
+        {
+            fonts.back().size = std::stoi(values.at(0));
+            fonts.back().bw = (values.size() == 2 && values.at(1) == "bw");
+        }
+        else if (tag == "Chars")
+        {
+            fonts.back().chars = values;
+        }
+        else if (tag == "Iterations")
+        {
+            fonts.back().iterations = std::stoi(values.at(0));
+        }
+        else if (tag == "Format")
+        {
+            fonts.back().format = values.at(0);
+        }
+        else if (tag == "Dat")
+        {
+            fonts.back().datfile = values.at(0);
+        }
+        else if (tag == "LookupWeight")
+        {
+            fonts.back().lookup_weight = std::stod(values.at(0));
+        }
+        else
+        {
+            throw std::runtime_error("Line " + std::to_string(lineno) +
+                                     ": unknown setting " + tag);
+        }
+    }
+
+    for (const build_font_t &font : fonts)
+    {
+        if (font.name.empty() || font.source.empty() ||
+            (font.format != "rlefont" && font.format != "bwfont"))
+        {
+            throw std::runtime_error("Font " + font.name +
+                                     " needs a Source and a valid Format");
+        }
+    }
+
+    return fonts;
+}
+
+static void build_log(const build_log_t &log, const build_font_t &font,
+                      const std::string &msg)
+{
+    log(font.name + ": " + msg);
+}
+
+// Run the import, filter, optimize and export steps for one font, keeping
+// the data file in memory between them.
+static bool build_font(const build_font_t &font,
+                       rlefont::optimize_options_t options,
+                       const rlefont::DictionaryCache *dictcache,
+                       const build_log_t &log)
+{
+    // The ranges are optimized for the same lookup weight as the export.
+    options.objective.lookup_weight = font.lookup_weight;
+
+    std::unique_ptr<DataFile> f;
+    size_t pos = font.source.find_last_of('.');
+    std::string ext = (pos == std::string::npos) ? "" : font.source.substr(pos);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    bool imported = (ext != ".dat" && ext != ".bdat");
+
+    if (!imported)
+    {
+        f = read_datafile(font.source);
+        if (!f)
+        {
+            build_log(log, font, "could not read " + font.source);
+            return false;
+        }
+    }
+    else
+    {
+        std::ifstream infile(font.source);
+        if (!infile.good())
+        {
+            build_log(log, font, "could not open " + font.source);
+            return false;
+        }
+
+        if (ext == ".bdf")
+            f = LoadBDF(infile);
+        else
+            f = LoadFreetype(infile, font.size, font.bw);
+    }
+
+    if (!f)
+        return false;
+
+    if (!font.chars.empty())
+        f = filter(*f, parse_char_set(font.chars));
+
+    // Unlike import_ttf and filter, the initial dictionary is built from
+    // the glyphs that are kept.
+    if (imported)
+        rlefont::init_dictionary(*f);
+
+    build_log(log, font, "imported " + std::to_string(f->GetGlyphCount()) + " glyphs");
+
+    if (font.iterations > 0 && dictcache && dictcache->Lookup(*f, font.iterations, options))
+    {
+        build_log(log, font, "found in cache");
+    }
+    else if (font.iterations > 0)
+    {
+        if (dictcache)
+        {
+            std::string key = warm_start(*dictcache, *f, options.fast);
+            if (!key.empty())
+                build_log(log, font, "starting from cache entry " + key);
+        }
+
+        rlefont::optimize_state_t state;
+        for (int i = 0; i < font.iterations; i++)
+            rlefont::optimize(*f, options, &state);
+
+        size_t size = rlefont::get_encoded_size(*f, false);
+        build_log(log, font, "optimized to " + std::to_string(size) + " bytes");
+
+        if (dictcache && !dictcache->Store(*f, font.iterations, options))
+            build_log(log, font, "could not store the result in the cache");
+    }
+
+    if (!font.datfile.empty() && !write_datafile(font.datfile, *f))
+    {
+        build_log(log, font, "could not write " + font.datfile);
+        return false;
+    }
+
+    std::string warning = dropped_chars_warning(*f);
+    if (!warning.empty())
+        build_log(log, font, warning);
+
+    std::string dst = font.name + ".c";
+    std::ofstream source(dst);
+    if (font.format == "bwfont")
+        bwfont::write_source(source, dst, *f, font.lookup_weight);
+    else
+        rlefont::write_source(source, dst, *f, font.lookup_weight);
+
+    if (!source.good())
+    {
+        build_log(log, font, "could not write " + dst);
+        return false;
+    }
+
+    build_log(log, font, "wrote " + dst);
+    return true;
+}
+
+bool build_fonts(const std::vector<build_font_t> &fonts, size_t threads,
+                 rlefont::optimize_options_t options,
+                 const rlefont::DictionaryCache *dictcache,
+                 const build_log_t &log)
+{
+    if (threads == 0)
+        threads = ThreadPool::GetDefaultThreadCount();
+
+    // The fonts are processed in parallel, so the log gets the messages
+    // one at a time under a lock.
+    std::mutex log_mutex;
+    build_log_t locked_log = [&](const std::string &line) {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        log(line);
+    };
+
+    // The fonts run side by side, and the threads left over are shared
+    // out to the optimizer of each.
+    ThreadPool pool(std::min(threads, fonts.size()));
+    options.threads = std::max<size_t>(1, threads / pool.GetThreadCount());
+
+    std::vector<char> ok(fonts.size(), 0);
+    pool.Run(fonts.size(), [&](size_t i) {
+        try
+        {
+            ok.at(i) = build_font(fonts.at(i), options, dictcache, locked_log);
+        }
+        catch (const std::exception &e)
+        {
+            build_log(locked_log, fonts.at(i), std::string("error: ") + e.what());
+        }
+    });
+
+    bool result = true;
+    for (size_t i = 0; i < fonts.size(); i++)
+    {
+        if (!ok.at(i))
+        {
+            build_log(log, fonts.at(i), "build failed");
+            result = false;
+        }
+    }
+
+    return result;
+}
+
+}}
@@ -0,0 +1,267 @@
+// Interface for using the encoder as a library. Most of the functions work
+// on DataFile objects and on file contents held in memory, so that a program
+// can build fonts without running the mcufont command or writing files. The
+// build functions at the end do what the build command does, on files.
+
+#pragma once
+#include "datafile.hh"
+#include "optimize_rlefont.hh"
+#include "cache_rlefont.hh"
+#include <set>
+#include <string>
+#include <vector>
+#include <istream>
+#include <functional>
+
+namespace mcufont {
+namespace encoder {
+
+// Import the contents of a font file. The fonts read by FreeType are
+// rendered at the given size in pixels, without antialiasing if bw is set.
+// The rlefont dictionary is left empty; call rlefont::init_dictionary()
+// after filter() to build it from the glyphs that are kept.
+// Throws std::runtime_error if the font can't be read.
+std::unique_ptr<DataFile> import_freetype(const std::string &data, int size, bool bw);
+std::unique_ptr<DataFile> import_bdf(const std::string &data);
+
+// Read or write a data file in the text or the binary format. The format
+// is detected when loading. Returns nullptr if the data is not valid.
+std::unique_ptr<DataFile> load_datafile(const std::string &data);
+std::string save_datafile(const DataFile &datafile, bool binary = false);
+
+// Write the data to a file under a temporary name, and rename it over the
+// file when complete. An interrupted write leaves the previous version in
+// place. Returns false if the file can't be written.
+bool write_file(const std::string &filename, const std::string &data);
+
+// Read or write a data file on disk, in the binary format if the name ends
+// in .bdat. The file is written with write_file(). Return nullptr or false
+// if the file can't be read or written.
+std::unique_ptr<DataFile> read_datafile(const std::string &filename);
+bool write_datafile(const std::string &filename, const DataFile &datafile);
+
+// Parse characters as given to the filter command: numbers, ranges such as
+// "0x20-0x7E", and "gb2312" for the characters of that charset.
+std::set<int> parse_char_set(const std::vector<std::string> &items);
+
+// Remove the characters that are not allowed, and the glyphs that are left
+// without any characters.
+std::unique_ptr<DataFile> filter(const DataFile &datafile, const std::set<int> &allowed);
+
+// Make the given number of optimize() calls, as rlefont_optimize does for
+// that many iterations.
+void optimize(DataFile &datafile, size_t iterations,
+              const rlefont::optimize_options_t &options = rlefont::optimize_options_t(),
+              rlefont::optimize_state_t *state = nullptr);
+
+// Size of the rlefont data, as exported.
+size_t encoded_size(const DataFile &datafile);
+
+// Generate the C source code for the font. The name is used for the
+// identifiers, as the file name is by the export commands. The lookup
+// weight is the cost in bytes of each character range.
+std::string export_rlefont(const DataFile &datafile, const std::string &name,
+                           double lookup_weight = DEFAULT_LOOKUP_WEIGHT);
+std::string export_bwfont(const DataFile &datafile, const std::string &name,
+                          double lookup_weight = DEFAULT_LOOKUP_WEIGHT);
+
+// Replace the dictionary with the one of the closest font in the cache, if
+// that makes the font smaller. Returns the key of the entry that was used,
+// or an empty string if the dictionary was kept.
+std::string warm_start(const rlefont::DictionaryCache &dictcache,
+                       DataFile &datafile, bool fast);
+
+// One font in the spec file of the build command.
+struct build_font_t
+{
+    std::string name;               // Output goes to name.c
+    std::string source;             // Font file to import, or a data file
+    int size = 0;                   // Size in pixels for FreeType fonts
+    bool bw = false;                // Import FreeType fonts without antialiasing
+    std::vector<std::string> chars; // Characters to keep, as for filter
+    int iterations = 50;            // As for rlefont_optimize
+    std::string format = "rlefont"; // rlefont or bwfont
+    std::string datfile;            // Save the data file here, if set
+    double lookup_weight = DEFAULT_LOOKUP_WEIGHT; // For dividing the ranges
+};
+
+// Read the spec file of the build command. Each font starts with a line
+// "Font <name>", followed by lines with its settings:
+//   Source <file>       .ttf or other FreeType font, .bdf, .dat or .bdat
+//   Size <pixels> [bw]  Size for FreeType fonts, black and white if bw
+//   Chars <range> ...   Characters to keep, as for the filter command
+//   Iterations <n>      Number of optimization iterations, default 50
+//   Format <format>     rlefont (default) or bwfont
+//   Dat <file>          Also save the data file
+//   LookupWeight <w>    Bytes that a character range is worth, default 16
+// Empty lines and lines starting with # are skipped.
+// Throws std::runtime_error if the spec is not valid.
+std::vector<build_font_t> load_build_spec(std::istream &file);
+
+// Receives the messages of build_fonts(), one line at a time.
+typedef std::function<void(const std::string &line)> build_log_t;
+
+// Run the import, filter, optimize and export steps for each font, keeping
+// the data file in memory between them. The fonts run side by side on the
+// given number of threads, 0 for all hardware threads, and the threads left
+// over are shared out to the optimizer of each. The log is called with one
+// line at a time, starting with the font name. Pass a null dictcache to
+// build without a cache. Returns false if any of the fonts failed.
+bool build_fonts(const std::vector<build_font_t> &fonts, size_t threads,
+                 rlefont::optimize_options_t options,
+                 const rlefont::DictionaryCache *dictcache,
+                 const build_log_t &log);
+
+}}
+
+#ifdef CXXTEST_RUNNING
+#include <cxxtest/TestSuite.h>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace mcufont;
+
+// A directory of its own for the files of a test, so that tests running
+// at the same time do not collide. The files named with Path() and the
+// directory are removed at the end of the test, also when it fails.
+class TempDir
+{
+public:
+    TempDir()
+    {
+        const char *tmp = std::getenv("TMPDIR");
+        std::string name = std::string(tmp ? tmp : "/tmp") + "/mcufont_test_XXXXXX";
+        std::vector<char> buf(name.begin(), name.end());
+        buf.push_back('\0');
+        if (mkdtemp(buf.data()))
+            m_path = buf.data();
+    }
+
+    ~TempDir()
+    {
+        for (const std::string &file : m_files)
+            std::remove(file.c_str());
+        if (!m_path.empty())
+            rmdir(m_path.c_str());
+    }
+
+    std::string Path(const std::string &name)
+    {
+        std::string path = m_path + "/" + name;
+        if (std::find(m_files.begin(), m_files.end(), path) == m_files.end())
+            m_files.push_back(path);
+        return path;
+    }
+
+private:
+    std::string m_path;
+    std::vector<std::string> m_files;
+};
+
+class EncoderTests: public CxxTest::TestSuite
+{
+public:
+    void testPipeline()
+    {
+        std::unique_ptr<DataFile> f = encoder::import_bdf(testfile);
+        TS_ASSERT_EQUALS(f->GetGlyphCount(), 2);
+
+        f = encoder::filter(*f, encoder::parse_char_set({"0x30-0x40"}));
+        TS_ASSERT_EQUALS(f->GetGlyphCount(), 1);
+        TS_ASSERT_EQUALS(f->GetGlyphEntry(0).chars.at(0), 0x31);
+
+        rlefont::init_dictionary(*f);
+        rlefont::optimize_options_t options;
+        options.iterations = 2;
+        options.threads = 1;
+        encoder::optimize(*f, 1, options);
+
+        std::unique_ptr<DataFile> f2 = encoder::load_datafile(encoder::save_datafile(*f, true));
+        TS_ASSERT_EQUALS(f2->GetGlyphCount(), 1);
+        TS_ASSERT_EQUALS(encoder::encoded_size(*f2), encoder::encoded_size(*f));
+
+        std::string source = encoder::export_rlefont(*f2, "testfont");
+        TS_ASSERT(source.find("testfont") != std::string::npos);
+    }
+
+    void testBuild()
+    {
+        // Two fonts, one imported from BDF and one read from a data file,
+        // built side by side in a directory of their own.
+        TempDir dir;
+        std::ofstream(dir.Path("a.bdf")) << testfile;
+        std::unique_ptr<DataFile> f = encoder::import_bdf(testfile);
+        TS_ASSERT(encoder::write_datafile(dir.Path("b.dat"), *f));
+        // The outputs are named too, so that they are removed at the end.
+        dir.Path("a.c");
+        dir.Path("b.c");
+        dir.Path("b.bdat");
+
+        std::istringstream spec(
+            "# Test spec\n"
+            "Font " + dir.Path("a") + "\n"
+            "Source " + dir.Path("a.bdf") + "\n"
+            "Chars 0x30-0x40\n"
+            "Iterations 1\n"
+            "\n"
+            "Font " + dir.Path("b") + "\n"
+            "Source " + dir.Path("b.dat") + "\n"
+            "Iterations 0\n"
+            "Format bwfont\n"
+            "Dat " + dir.Path("b.bdat") + "\n");
+        std::vector<encoder::build_font_t> fonts = encoder::load_build_spec(spec);
+        TS_ASSERT_EQUALS(fonts.size(), 2);
+
+        rlefont::optimize_options_t options;
+        options.fast = true;
+        std::vector<std::string> log;
+        TS_ASSERT(encoder::build_fonts(fonts, 2, options, nullptr,
+            [&](const std::string &line) { log.push_back(line); }));
+        TS_ASSERT(std::find(log.begin(), log.end(),
+            dir.Path("a") + ": wrote " + dir.Path("a.c")) != log.end());
+
+        std::ifstream source_a(dir.Path("a.c")), source_b(dir.Path("b.c"));
+        std::ostringstream text_a, text_b;
+        text_a << source_a.rdbuf();
+        text_b << source_b.rdbuf();
+        TS_ASSERT(text_a.str().find("mf_rlefont_a") != std::string::npos);
+        TS_ASSERT(text_b.str().find("mf_bwfont_b") != std::string::npos);
+
+        std::unique_ptr<DataFile> saved = encoder::read_datafile(dir.Path("b.bdat"));
+        TS_ASSERT(saved && saved->GetGlyphCount() == 2);
+
+        std::istringstream bad("Source a.bdf\n");
+        TS_ASSERT_THROWS(encoder::load_build_spec(bad), std::runtime_error);
+    }
+
+private:
+    static constexpr const char *testfile =
+        "STARTFONT 2.1\n"
+        "FONT -Misc-Fixed-Medium-R-Normal--14-130-75-75-C-70-ISO8859-15\n"
+        "FONTBOUNDINGBOX 7 14 0 -2\n"
+        "STARTCHAR A\n"
+        "ENCODING 65\n"
+        "DWIDTH 7 0\n"
+        "BBX 7 4 0 -2\n"
+        "BITMAP\n"
+        "10\n"
+        "28\n"
+        "7C\n"
+        "44\n"
+        "ENDCHAR\n"
+        "STARTCHAR one\n"
+        "ENCODING 49\n"
+        "DWIDTH 7 0\n"
+        "BBX 7 4 0 -2\n"
+        "BITMAP\n"
+        "10\n"
+        "30\n"
+        "10\n"
+        "38\n"
+        "ENDCHAR\n";
+};
+#endif
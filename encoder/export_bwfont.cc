@@ -143,7 +143,8 @@ static void encode_character_range(std::ostream &out,
     }
 }
 
-void write_source(std::ostream &out, std::string name, const DataFile &datafile)
+void write_source(std::ostream &out, std::string name, const DataFile &datafile,
+                  double lookup_weight)
 {
     name = filename_to_identifier(name);
 
@@ -167,8 +168,18 @@ void write_source(std::ostream &out, std::string name, const DataFile &datafile)
     DataFile::fontinfo_t f = datafile.GetFontInfo();
     size_t glyph_size = f.max_width * ((f.max_height + 7) / 8);
     auto get_glyph_size = [=](size_t i) { return glyph_size; };
+
+    // The offset and width tables are left out of ranges where all the
+    // glyphs have the same width, which is not known before dividing them.
+    // Each character gets its own copy of the glyph.
+    char_range_costs_t costs;
+    costs.range_size = 24 + 2; // Struct and the end of the offset table
+    costs.char_size = 2 + 1;   // Offset and width
+    costs.missing_size = 0;
+    costs.shared_glyphs = false;
+    costs.lookup_weight = lookup_weight;
     std::vector<char_range_t> ranges = compute_char_ranges(datafile,
-        get_glyph_size, 65536, 16);
+        get_glyph_size, 65536, costs);
 
     // Write out glyph data for character ranges
     std::vector<cropinfo_t> crops;
@@ -3,6 +3,7 @@
 #pragma once
 
 #include "datafile.hh"
+#include "exporttools.hh"
 #include <iostream>
 
 namespace mcufont {
@@ -10,7 +11,10 @@ namespace bwfont {
 
 void write_header(std::ostream &out, std::string name, const DataFile &datafile);
 
-void write_source(std::ostream &out, std::string name, const DataFile &datafile);
+// The lookup weight is the cost in bytes of each character range, see
+// compute_char_ranges().
+void write_source(std::ostream &out, std::string name, const DataFile &datafile,
+                  double lookup_weight = DEFAULT_LOOKUP_WEIGHT);
 
 } }
 
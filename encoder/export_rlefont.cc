@@ -82,10 +82,11 @@ static void encode_character_range(std::ostream &out,
     write_const_table(out, offsets, "uint16_t", "mf_rlefont_" + name + "_glyph_offsets_" + std::to_string(range_index), 1, 4);
 }
 
-void write_source(std::ostream &out, std::string name, const DataFile &datafile)
+void write_source(std::ostream &out, std::string name, const DataFile &datafile,
+                  ThreadPool &pool, double lookup_weight)
 {
     name = filename_to_identifier(name);
-    std::unique_ptr<encoded_font_t> encoded = encode_font(datafile, false);
+    std::unique_ptr<encoded_font_t> encoded = encode_font(datafile, false, pool);
 
     out << std::endl;
     out << std::endl;
@@ -107,12 +108,11 @@ void write_source(std::ostream &out, std::string name, const DataFile &datafile)
     encode_dictionary(out, name, datafile, *encoded);
 
     // Split the characters into ranges
-    auto get_glyph_size = [&encoded](size_t i)
-    {
-        return encoded->glyphs[i].size() + 1; // +1 byte for glyph width
-    };
-    std::vector<char_range_t> ranges = compute_char_ranges(datafile,
-        get_glyph_size, 65536, 16);
+    std::vector<size_t> glyph_sizes;
+    for (const encoded_font_t::refstring_t &r : encoded->glyphs)
+        glyph_sizes.push_back(r.size() + 1); // +1 byte for glyph width
+    std::vector<char_range_t> ranges = get_char_ranges(datafile, glyph_sizes,
+        RLEFONT_MAX_RANGE_DATA, lookup_weight);
 
     // Write out glyph data for character ranges
     for (size_t i = 0; i < ranges.size(); i++)
@@ -177,5 +177,12 @@ void write_source(std::ostream &out, std::string name, const DataFile &datafile)
     out << std::endl;
 }
 
+void write_source(std::ostream &out, std::string name, const DataFile &datafile,
+                  double lookup_weight)
+{
+    ThreadPool serial(1);
+    write_source(out, name, datafile, serial, lookup_weight);
+}
+
 }}
 
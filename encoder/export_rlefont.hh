@@ -9,7 +9,13 @@
 namespace mcufont {
 namespace rlefont {
 
-void write_source(std::ostream &out, std::string name, const DataFile &datafile);
+// Encodes the font on the threads of the pool. The version without a pool
+// encodes in the calling thread. The lookup weight is the cost in bytes of
+// each character range, see compute_char_ranges().
+void write_source(std::ostream &out, std::string name, const DataFile &datafile,
+                  ThreadPool &pool, double lookup_weight = DEFAULT_LOOKUP_WEIGHT);
+void write_source(std::ostream &out, std::string name, const DataFile &datafile,
+                  double lookup_weight = DEFAULT_LOOKUP_WEIGHT);
 
 } }
 
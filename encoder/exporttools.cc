@@ -1,6 +1,9 @@
 #include "exporttools.hh"
 #include <iomanip>
+#include <sstream>
+#include <algorithm>
 #include <set>
+#include <limits>
 
 namespace mcufont {
 
@@ -116,65 +119,152 @@ int select_fallback_char(const DataFile &datafile)
     return ' ';
 }
 
-// Decide how to best divide the characters in the font into ranges.
-// Limitations are:
-//  - Gaps longer than minimum_gap should result in separate ranges.
-//  - Each range can have encoded data size of at most maximum_size.
+// Divide the characters, given in numeric order, into the ranges of least
+// total cost, and return the index of the first character of each range.
+// The ranges are made of segments, which are runs of consecutive characters
+// that are cut where they would exceed maximum_size. A range costs
+//   char_size * span + range_size + lookup_weight
+// plus missing_size if there are gaps in it, plus the data of the shared
+// glyphs that have more than one character, as these are stored in each
+// range that has one of them. The data of the other glyphs is the same however
+// the characters are divided, so the result does not depend on it.
+static std::vector<size_t> divide_chars(const std::vector<size_t> &chars,
+                                        const std::vector<size_t> &glyphs,
+                                        const std::vector<size_t> &sizes,
+                                        const std::vector<bool> &shared,
+                                        size_t glyph_count,
+                                        size_t maximum_size,
+                                        const char_range_costs_t &costs)
+{
+    std::vector<size_t> segments;
+    size_t data = 0;
+    for (size_t i = 0; i < chars.size(); i++)
+    {
+        data += sizes[i];
+        if (i == 0 || chars[i] != chars[i - 1] + 1 || data > maximum_size)
+        {
+            segments.push_back(i);
+            data = sizes[i];
+        }
+    }
+    segments.push_back(chars.size());
+
+    // best[b] is the least cost of the segments before b, and start[b] the
+    // first segment of the last range in it.
+    size_t count = segments.size() - 1;
+    std::vector<double> best(count + 1, 0);
+    std::vector<size_t> start(count + 1, 0);
+    std::vector<size_t> seen(glyph_count, count);
+
+    for (size_t b = 0; b < count; b++)
+    {
+        size_t end = segments[b + 1];
+        size_t data = 0;
+        double shared_data = 0;
+        best[b + 1] = std::numeric_limits<double>::infinity();
+
+        // Try each start for the range that ends with segment b.
+        for (size_t a = b + 1; a-- > 0; )
+        {
+            for (size_t i = segments[a]; i < segments[a + 1]; i++)
+            {
+                data += sizes[i];
+                if (shared[i] && seen[glyphs[i]] != b)
+                {
+                    seen[glyphs[i]] = b;
+                    shared_data += sizes[i];
+                }
+            }
+
+            size_t span = chars[end - 1] - chars[segments[a]] + 1;
+            if (a < b && (data > maximum_size || span > 0xFFFF))
+                break;
+
+            double cost = best[a] + (double)costs.char_size * span +
+                          costs.range_size + costs.lookup_weight + shared_data;
+            if (span > end - segments[a])
+                cost += costs.missing_size;
+
+            if (cost < best[b + 1])
+            {
+                best[b + 1] = cost;
+                start[b + 1] = a;
+            }
+        }
+    }
+
+    // Collect the ranges from the end.
+    std::vector<size_t> result;
+    for (size_t b = count; b > 0; b = start[b])
+        result.push_back(segments[start[b]]);
+    std::reverse(result.begin(), result.end());
+    return result;
+}
+
 std::vector<char_range_t> compute_char_ranges(const DataFile &datafile,
     std::function<size_t(size_t)> get_encoded_glyph_size,
     size_t maximum_size,
-    size_t minimum_gap)
+    const char_range_costs_t &costs)
 {
     std::vector<char_range_t> result;
     std::map<size_t, size_t> char_to_glyph = datafile.GetCharToGlyphMap();
     std::vector<size_t> chars;
+    std::vector<size_t> glyphs;
+    std::vector<size_t> sizes;
+    std::vector<size_t> char_counts(datafile.GetGlyphCount(), 0);
 
-    // Get list of all characters in numeric order.
+    // Get list of all characters in numeric order. The decoder has 16-bit
+    // characters, so the ones above cannot be looked up, and the export
+    // commands warn about them.
     for (auto iter : char_to_glyph)
+    {
+        if (iter.first > 0xFFFF)
+            break;
+
         chars.push_back(iter.first);
+        glyphs.push_back(iter.second);
+        sizes.push_back(get_encoded_glyph_size(iter.second));
+        char_counts.at(iter.second)++;
+    }
 
-    // Pick out ranges until we have processed all characters
-    size_t i = 0;
-    while (i < chars.size())
+    std::vector<bool> shared;
+    for (size_t glyph : glyphs)
+        shared.push_back(costs.shared_glyphs && char_counts[glyph] > 1);
+
+    // Divide without the size limit first, so that the sizes of the glyphs
+    // with a single character only matter if the limit is reached.
+    std::vector<size_t> starts = divide_chars(chars, glyphs, sizes, shared,
+        datafile.GetGlyphCount(), std::numeric_limits<size_t>::max(), costs);
+    starts.push_back(chars.size());
+
+    for (size_t r = 0; r + 1 < starts.size(); r++)
     {
-        char_range_t range;
-        range.first_char = chars.at(i);
+        size_t data = 0;
+        for (size_t i = starts[r]; i < starts[r + 1]; i++)
+            data += sizes[i];
 
-        // Find the point where there is a gap larger than minimum_gap.
-        i++;
-        while (i < chars.size() && chars.at(i) - chars.at(i - 1) < minimum_gap)
-            i++;
+        if (data > maximum_size && starts[r + 1] - starts[r] > 1)
+        {
+            starts = divide_chars(chars, glyphs, sizes, shared,
+                datafile.GetGlyphCount(), maximum_size, costs);
+            starts.push_back(chars.size());
+            break;
+        }
+    }
 
-        uint16_t last_char = chars.at(i - 1);
+    // Then store the indices of glyphs for each character
+    for (size_t r = 0; r + 1 < starts.size(); r++)
+    {
+        char_range_t range;
+        range.first_char = chars.at(starts[r]);
+        size_t last_char = chars.at(starts[r + 1] - 1);
 
-        // Then store the indices of glyphs for each character
-        size_t data_length = 0;
         for (size_t j = range.first_char; j <= last_char; j++)
         {
             if (char_to_glyph.count(j) == 0)
-            {
-                // Missing character
-                range.glyph_indices.push_back(-1);
-                continue;
-            }
-
-            int glyph_index = char_to_glyph[j];
-
-            // Monitor the amount of the data in the range and split it
-            // if it grows too large.
-            data_length += get_encoded_glyph_size(glyph_index);
-            if (data_length > maximum_size)
-            {
-                last_char = j - 1;
-
-                // Return the rest of characters to be processed by next range.
-                while (chars.at(i-1) > last_char)
-                    i--;
-
-                break;
-            }
-
-            range.glyph_indices.push_back(glyph_index);
+                range.glyph_indices.push_back(-1); // Missing character
+            else
+                range.glyph_indices.push_back(char_to_glyph[j]);
         }
 
         range.char_count = last_char - range.first_char + 1;
@@ -184,5 +274,44 @@ std::vector<char_range_t> compute_char_ranges(const DataFile &datafile,
     return result;
 }
 
+std::vector<int> get_dropped_chars(const DataFile &datafile)
+{
+    std::vector<int> result;
+    for (const DataFile::glyphentry_t &g : datafile.GetGlyphTable())
+    {
+        for (int c : g.chars)
+        {
+            if (c > 0xFFFF)
+                result.push_back(c);
+        }
+    }
+
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+std::string dropped_chars_warning(const DataFile &datafile)
+{
+    std::vector<int> chars = get_dropped_chars(datafile);
+    if (chars.empty())
+        return std::string();
+
+    std::ostringstream msg;
+    msg << "Warning: " << chars.size() << " characters above 0xFFFF are left out:";
+    msg << std::hex << std::uppercase;
+    for (size_t i = 0; i < chars.size(); )
+    {
+        size_t j = i;
+        while (j + 1 < chars.size() && chars[j + 1] == chars[j] + 1)
+            j++;
+
+        msg << " 0x" << chars[i];
+        if (j > i)
+            msg << "-0x" << chars[j];
+        i = j + 1;
+    }
+
+    return msg.str();
+}
 
 }
@@ -40,13 +40,41 @@ struct char_range_t
     char_range_t(): first_char(0), char_count(0) {}
 };
 
-// Decide how to best divide the characters in the font into ranges.
-// Limitations are:
-//  - Gaps longer than minimum_gap should result in separate ranges.
-//  - Each range can have encoded data size of at most maximum_size.
+// What a character range costs in a font format, for dividing the
+// characters into ranges. The sizes are in bytes.
+struct char_range_costs_t
+{
+    size_t range_size;    // Struct describing the range and its fixed tables.
+    size_t char_size;     // Table entries for each character, also missing ones.
+    size_t missing_size;  // Glyph shared by the missing characters of a range.
+    bool shared_glyphs;   // Characters with the same glyph share its data.
+
+    // Bytes worth one range less. The decoder scans the ranges in order to
+    // find a character, so each range adds to the time of the lookup.
+    double lookup_weight;
+};
+
+// Weight of a range for find_glyph() to scan. With this, both formats
+// start a new range at gaps of about 15 missing characters.
+#define DEFAULT_LOOKUP_WEIGHT 16
+
+// Decide how to best divide the characters in the font into ranges. The
+// ranges minimize the size of the tables, and of the glyphs stored in more
+// than one range if shared_glyphs is set, plus lookup_weight for each range.
+// Each range can have encoded data size of at most maximum_size. The sizes
+// of the glyphs with a single character only matter if some range would
+// exceed it.
 std::vector<char_range_t> compute_char_ranges(const DataFile &datafile,
     std::function<size_t(size_t)> get_encoded_glyph_size,
     size_t maximum_size,
-    size_t minimum_gap);
+    const char_range_costs_t &costs);
+
+// Get the characters that compute_char_ranges() leaves out, because they
+// are above 0xFFFF and the decoder has 16-bit characters.
+std::vector<int> get_dropped_chars(const DataFile &datafile);
+
+// Warning about the characters that the export formats leave out, listed
+// as ranges, or an empty string if there are none.
+std::string dropped_chars_warning(const DataFile &datafile);
 
 }
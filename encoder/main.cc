@@ -6,6 +6,9 @@
 #include "encode_rlefont.hh"
 #include "optimize_rlefont.hh"
 #include "export_bwfont.hh"
+#include "threadpool.hh"
+#include "encoder.hh"
+#include "cache_rlefont.hh"
 #include <vector>
 #include <string>
 #include <set>
@@ -14,9 +17,14 @@
 #include <iomanip>
 #include <cstdlib>
 #include <ctime>
+#include <chrono>
 #include <map>
+#include <algorithm>
+#include <thread>
+#include <sstream>
+#include <cmath>
+#include <stdexcept>
 #include "ccfixes.hh"
-#include "gb2312_in_ucs2.h"
 
 using namespace mcufont;
 
@@ -36,7 +44,7 @@ static std::string strip_extension(std::string filename)
 
 static std::unique_ptr<DataFile> load_dat(std::string src)
 {
-    std::ifstream infile(src);
+    std::ifstream infile(src, std::ios::binary);
 
     if (!infile.good())
     {
@@ -44,7 +52,16 @@ static std::unique_ptr<DataFile> load_dat(std::string src)
         return nullptr;
     }
 
-    std::unique_ptr<DataFile> f = DataFile::Load(infile);
+    std::unique_ptr<DataFile> f;
+    try
+    {
+        f = DataFile::Load(infile);
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+
     if (!f)
     {
         std::cerr << "Invalid format for .dat file: " << src << std::endl;
@@ -54,19 +71,32 @@ static std::unique_ptr<DataFile> load_dat(std::string src)
     return f;
 }
 
-static bool save_dat(std::string dest, DataFile *f)
+// Data files named *.bdat are saved in the binary format, see
+// encoder::write_datafile().
+static bool save_dat(std::string dest, const DataFile *f)
 {
-    std::ofstream outfile(dest);
-
-    if (!outfile.good())
+    if (!encoder::write_datafile(dest, *f))
     {
-        std::cerr << "Could not open " << dest << std::endl;
+        std::cerr << "Could not write to " << dest << std::endl;
         return false;
     }
 
-    f->Save(outfile);
+    return true;
+}
+
+// The optimizer state of rlefont_optimize is kept next to the data file.
+static std::string state_filename(const std::string &datfile)
+{
+    return datfile + ".state";
+}
+
+static bool save_state(std::string dest, const rlefont::optimize_state_t &state,
+                       const DataFile &f)
+{
+    std::ostringstream output;
+    rlefont::save_state(output, state, f);
 
-    if (!outfile.good())
+    if (!encoder::write_file(dest, output.str()))
     {
         std::cerr << "Could not write to " << dest << std::endl;
         return false;
@@ -75,6 +105,82 @@ static bool save_dat(std::string dest, DataFile *f)
     return true;
 }
 
+// Writes the checkpoints of rlefont_optimize on a background thread, so
+// that the optimizer does not wait for the disk. The data file goes first,
+// so a state file that is newer than its data file does not match its
+// seed and is ignored on resume.
+class CheckpointWriter
+{
+public:
+    explicit CheckpointWriter(const std::string &datfile):
+        m_datfile(datfile), m_ok(true) {}
+    ~CheckpointWriter() { Wait(); }
+
+    CheckpointWriter(const CheckpointWriter &other) = delete;
+    CheckpointWriter &operator=(const CheckpointWriter &other) = delete;
+
+    // Start writing copies of the data file and the state, after the
+    // previous checkpoint is complete.
+    void Write(const DataFile &f, const rlefont::optimize_state_t &state)
+    {
+        Wait();
+        m_thread = std::thread([this, f, state]() {
+            if (!save_dat(m_datfile, &f) ||
+                !save_state(state_filename(m_datfile), state, f))
+            {
+                m_ok = false;
+            }
+        });
+    }
+
+    // Wait for the last checkpoint. Returns false if any of them failed.
+    bool Wait()
+    {
+        if (m_thread.joinable())
+            m_thread.join();
+        return m_ok;
+    }
+
+private:
+    std::string m_datfile;
+    std::thread m_thread;
+    bool m_ok;
+};
+
+// Remove "--name value" from the argument list and store the value.
+// Returns false if the option is not present.
+static bool pop_option(std::vector<std::string> &args, const std::string &name,
+                       std::string &value)
+{
+    for (size_t i = 1; i + 1 < args.size(); i++)
+    {
+        if (args.at(i) == name)
+        {
+            value = args.at(i + 1);
+            args.erase(args.begin() + i, args.begin() + i + 2);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Remove "--name" from the argument list.
+// Returns false if the flag is not present.
+static bool pop_flag(std::vector<std::string> &args, const std::string &name)
+{
+    for (size_t i = 1; i < args.size(); i++)
+    {
+        if (args.at(i) == name)
+        {
+            args.erase(args.begin() + i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
 enum status_t
 {
     STATUS_OK = 0, // All good
@@ -145,36 +251,8 @@ static status_t cmd_filter(const std::vector<std::string> &args)
     if (args.size() < 3)
         return STATUS_INVALID;
 
-    std::set<int> allowed;
-
-    // Parse arguments
-    for (size_t i = 2; i < args.size(); i++)
-    {
-        std::string s = args.at(i);
-        size_t pos = s.find('-');
-        if (pos == std::string::npos)
-        {
-            if(s == "gb2312") {
-                allowed.insert(
-                    &gb2312_in_ucs2_codetable[0],
-                    &gb2312_in_ucs2_codetable[sizeof(gb2312_in_ucs2_codetable)/sizeof(gb2312_in_ucs2_codetable[0])]);
-            } else {
-                // Single char
-                allowed.insert(std::stoi(s, nullptr, 0));
-            }
-        }
-        else
-        {
-            // Range
-            int start = std::stoi(s.substr(0, pos), nullptr, 0);
-            int end = std::stoi(s.substr(pos + 1), nullptr, 0);
-
-            for (int j = start; j <= end; j++)
-            {
-                allowed.insert(j);
-            }
-        }
-    }
+    std::set<int> allowed = encoder::parse_char_set(
+        std::vector<std::string>(args.begin() + 2, args.end()));
 
     std::string src = args.at(1);
     std::unique_ptr<DataFile> f = load_dat(src);
@@ -183,37 +261,31 @@ static status_t cmd_filter(const std::vector<std::string> &args)
 
     std::cout << "Font originally had " << f->GetGlyphCount() << " glyphs." << std::endl;
 
-    // Filter the glyphs
-    std::vector<DataFile::glyphentry_t> newglyphs;
-    for (size_t i = 0; i < f->GetGlyphCount(); i++)
-    {
-        DataFile::glyphentry_t g = f->GetGlyphEntry(i);
+    f = encoder::filter(*f, allowed);
+    std::cout << "After filtering, " << f->GetGlyphCount() << " glyphs remain." << std::endl;
 
-        for (size_t j = 0; j < g.chars.size(); j++)
-        {
-            if (!allowed.count(g.chars.at(j)))
-            {
-                g.chars.erase(g.chars.begin() + j);
-                j--;
-            }
-        }
+    if (!save_dat(src, f.get()))
+        return STATUS_ERROR;
 
-        if (g.chars.size())
-        {
-            newglyphs.push_back(g);
-        }
-    }
+    return STATUS_OK;
+}
+
+static status_t cmd_convert(const std::vector<std::string> &args)
+{
+    if (args.size() != 3)
+        return STATUS_INVALID;
 
-    DataFile::fontinfo_t fontinfo = f->GetFontInfo();
-    crop_glyphs(newglyphs, fontinfo);
-    detect_flags(newglyphs, fontinfo);
+    std::string src = args.at(1);
+    std::string dst = args.at(2);
+    std::unique_ptr<DataFile> f = load_dat(src);
 
-    f.reset(new DataFile(f->GetDictionary(), newglyphs, fontinfo));
-    std::cout << "After filtering, " << f->GetGlyphCount() << " glyphs remain." << std::endl;
+    if (!f)
+        return STATUS_ERROR;
 
-    if (!save_dat(src, f.get()))
+    if (!save_dat(dst, f.get()))
         return STATUS_ERROR;
 
+    std::cout << "Wrote " << dst << std::endl;
     return STATUS_OK;
 }
 
@@ -267,8 +339,14 @@ static status_t cmd_show_glyph(const std::vector<std::string> &args)
     return STATUS_OK;
 }
 
-static status_t cmd_rlefont_export(const std::vector<std::string> &args)
+static status_t cmd_rlefont_export(const std::vector<std::string> &cmdline)
 {
+    std::vector<std::string> args = cmdline;
+    std::string value;
+    double lookup_weight = DEFAULT_LOOKUP_WEIGHT;
+    if (pop_option(args, "--lookup-weight", value))
+        lookup_weight = std::stod(value);
+
     if (args.size() != 2 && args.size() != 3)
         return STATUS_INVALID;
 
@@ -279,17 +357,28 @@ static status_t cmd_rlefont_export(const std::vector<std::string> &args)
     if (!f)
         return STATUS_ERROR;
 
+    std::string warning = dropped_chars_warning(*f);
+    if (!warning.empty())
+        std::cout << warning << std::endl;
+
     {
+        ThreadPool pool(ThreadPool::GetDefaultThreadCount());
         std::ofstream source(dst);
-        mcufont::rlefont::write_source(source, dst, *f);
+        mcufont::rlefont::write_source(source, dst, *f, pool, lookup_weight);
         std::cout << "Wrote " << dst << std::endl;
     }
 
     return STATUS_OK;
 }
 
-static status_t cmd_rlefont_size(const std::vector<std::string> &args)
+static status_t cmd_rlefont_size(const std::vector<std::string> &cmdline)
 {
+    std::vector<std::string> args = cmdline;
+    std::string value;
+    double lookup_weight = DEFAULT_LOOKUP_WEIGHT;
+    if (pop_option(args, "--lookup-weight", value))
+        lookup_weight = std::stod(value);
+
     if (args.size() != 2)
         return STATUS_INVALID;
 
@@ -299,7 +388,34 @@ static status_t cmd_rlefont_size(const std::vector<std::string> &args)
     if (!f)
         return STATUS_ERROR;
 
-    size_t size = mcufont::rlefont::get_encoded_size(*f);
+    ThreadPool pool(ThreadPool::GetDefaultThreadCount());
+    std::unique_ptr<mcufont::rlefont::encoded_font_t> e =
+        mcufont::rlefont::encode_font(*f, false, pool);
+    size_t size = mcufont::rlefont::get_encoded_size(*f, *e, lookup_weight);
+
+    // The part of the size in the character ranges.
+    std::vector<size_t> glyph_sizes;
+    for (const mcufont::rlefont::encoded_font_t::refstring_t &r : e->glyphs)
+        glyph_sizes.push_back(r.size() + 1);
+    std::vector<mcufont::char_range_t> ranges =
+        mcufont::rlefont::get_char_ranges(*f, glyph_sizes,
+            RLEFONT_MAX_RANGE_DATA, lookup_weight);
+    size_t ranges_size = mcufont::rlefont::get_char_ranges_size(ranges, glyph_sizes);
+
+    // Work of the decoder per glyph, on average and for the slowest glyph.
+    mcufont::rlefont::decode_cost_t total, worst;
+    size_t worst_total = 0;
+    for (size_t i = 0; i < f->GetGlyphCount(); i++)
+    {
+        mcufont::rlefont::decode_cost_t c =
+            mcufont::rlefont::get_decode_cost(*e, i, f->GetFontInfo());
+        total.bytes += c.bytes;
+        total.callbacks += c.callbacks;
+        worst.bytes = std::max(worst.bytes, c.bytes);
+        worst.callbacks = std::max(worst.callbacks, c.callbacks);
+        worst.depth = std::max(worst.depth, c.depth);
+        worst_total = std::max(worst_total, c.GetTotal());
+    }
 
     std::cout << "Glyph count:       " << f->GetGlyphCount() << std::endl;
     std::cout << "Glyph bbox:        " << f->GetFontInfo().max_width << "x"
@@ -308,12 +424,209 @@ static status_t cmd_rlefont_size(const std::vector<std::string> &args)
         f->GetFontInfo().max_width * f->GetFontInfo().max_height / 2
         << " bytes" << std::endl;
     std::cout << "Compressed size:   " << size << " bytes" << std::endl;
+    std::cout << "  Dictionary:      " << size - ranges_size << " bytes" << std::endl;
+    std::cout << "  Glyphs:          " << ranges_size << " bytes in "
+        << ranges.size() << " character ranges" << std::endl;
     std::cout << "Bytes per glyph:   " << size / f->GetGlyphCount() << std::endl;
+    std::cout << "Decode cost:       " << total.GetTotal() / f->GetGlyphCount()
+        << " average, " << worst_total << " max per glyph" << std::endl;
+    std::cout << "  Bytes read:      " << total.bytes / f->GetGlyphCount()
+        << " average, " << worst.bytes << " max" << std::endl;
+    std::cout << "  Callbacks:       " << total.callbacks / f->GetGlyphCount()
+        << " average, " << worst.callbacks << " max" << std::endl;
+    std::cout << "  Nesting depth:   " << worst.depth << " max" << std::endl;
     return STATUS_OK;
 }
 
-static status_t cmd_rlefont_optimize(const std::vector<std::string> &args)
+// Weight the glyphs of the font by how often they occur in a text file.
+static bool load_glyph_weights(const std::string &corpus, const DataFile &f,
+                               std::vector<double> &weights)
+{
+    std::ifstream infile(corpus, std::ios::binary);
+    if (!infile.good())
+    {
+        std::cerr << "Could not open " << corpus << std::endl;
+        return false;
+    }
+
+    std::ostringstream text;
+    text << infile.rdbuf();
+    weights = mcufont::rlefont::get_glyph_weights(f, text.str());
+
+    size_t used = std::count_if(weights.begin(), weights.end(),
+                                [](double w) { return w > 0; });
+    std::cout << used << " of " << f.GetGlyphCount()
+              << " glyphs occur in " << corpus << std::endl;
+    return true;
+}
+
+// Largest total decode cost of a single glyph.
+static size_t max_decode_cost(const mcufont::rlefont::encoded_font_t &e,
+                              const DataFile::fontinfo_t &fontinfo)
+{
+    size_t result = 0;
+    for (size_t i = 0; i < e.glyphs.size(); i++)
+        result = std::max(result, mcufont::rlefont::get_decode_cost(e, i, fontinfo).GetTotal());
+    return result;
+}
+
+// Decode weight used with --corpus when none is given: a hundred bytes read
+// per average glyph draw are worth a byte of flash.
+#define DEFAULT_DECODE_WEIGHT 0.01
+
+// Take the options that set how the optimizer searches and what it
+// minimizes out of args. Returns false if one of them is not valid.
+static bool parse_optimize_options(std::vector<std::string> &args,
+                                   mcufont::rlefont::optimize_options_t &options)
+{
+    std::string value;
+
+    if (pop_option(args, "--threads", value))
+        options.threads = std::stoi(value);
+
+    if (pop_option(args, "--tasks", value))
+        options.tasks = std::stoi(value);
+
+    if (pop_flag(args, "--fast"))
+        options.fast = true;
+
+    if (pop_option(args, "--method", value))
+    {
+        if (value == "random")
+            options.method = mcufont::rlefont::METHOD_RANDOM;
+        else if (value == "repair")
+            options.method = mcufont::rlefont::METHOD_REPAIR;
+        else
+            return false;
+    }
+
+    if (pop_flag(args, "--adaptive"))
+        options.adaptive = true;
+
+    if (pop_option(args, "--anneal", value))
+        options.temperature = std::stod(value);
+
+    if (pop_option(args, "--cooling", value))
+        options.cooling = std::stod(value);
+
+    if (pop_option(args, "--islands", value))
+        options.islands = std::stoi(value);
+
+    if (pop_option(args, "--migrate", value))
+        options.migration = std::stoi(value);
+
+    if (pop_option(args, "--batch", value))
+        options.batch = std::stoi(value);
+
+    if (pop_option(args, "--sample", value))
+        options.sample = std::stoi(value);
+
+    if (pop_option(args, "--max-decode-cost", value))
+        options.objective.max_glyph_cost = std::stoi(value);
+
+    return true;
+}
+
+// Put back the optimizer state saved with the last checkpoint of src, so
+// that the run continues as if it had not been stopped. If there is none
+// that matches the data file, the state is left empty.
+static void resume_state(const std::string &src, DataFile &f,
+                         mcufont::rlefont::optimize_state_t &state)
+{
+    std::ifstream statefile(state_filename(src));
+    if (statefile.good() && mcufont::rlefont::load_state(statefile, state, f))
+    {
+        std::cout << "Resuming after iteration " << state.iterations << std::endl;
+    }
+    else
+    {
+        std::cout << "No matching state in " << state_filename(src)
+                  << ", starting over" << std::endl;
+        state = mcufont::rlefont::optimize_state_t();
+    }
+}
+
+// Take the dictionary of a cached result for the same glyphs and options
+// that has had at least limit iterations, and return true, as the run is
+// then unnecessary. Otherwise start from the closest entry, if there is
+// one, and set size to the size from there.
+static bool start_from_cache(const mcufont::rlefont::DictionaryCache &dictcache,
+                             DataFile &f, int limit,
+                             const mcufont::rlefont::optimize_options_t &options,
+                             mcufont::rlefont::EncodingCache &cache, size_t &size)
+{
+    if (limit > 0 && dictcache.Lookup(f, limit, options))
+    {
+        std::cout << "Found in cache, size "
+                  << cache.GetEncodedSize(f, options.fast) << " bytes" << std::endl;
+        return true;
+    }
+
+    std::string key = mcufont::encoder::warm_start(dictcache, f, options.fast);
+    if (!key.empty())
+    {
+        size = cache.GetEncodedSize(f, options.fast);
+        std::cout << "Starting from cache entry " << key << ", size "
+                  << size << " bytes" << std::endl;
+    }
+
+    return false;
+}
+
+// Take the dictionary entries of another data file that make the font
+// smaller, and set size to the size after that. Returns false if the file
+// could not be loaded.
+static bool seed_from_file(const std::string &filename, DataFile &f,
+                           const mcufont::rlefont::optimize_options_t &options,
+                           mcufont::rlefont::EncodingCache &cache, size_t &size)
+{
+    std::unique_ptr<DataFile> other = load_dat(filename);
+    if (!other)
+        return false;
+
+    size_t taken = mcufont::rlefont::seed_dictionary(f, *other, options);
+    size = cache.GetEncodedSize(f, options.fast);
+    std::cout << "Took " << taken << " entries from " << filename
+              << ", size " << size << " bytes" << std::endl;
+    return true;
+}
+
+static status_t cmd_rlefont_optimize(const std::vector<std::string> &cmdline)
 {
+    std::vector<std::string> args = cmdline;
+    mcufont::rlefont::optimize_options_t options;
+    std::string value;
+
+    if (!parse_optimize_options(args, options))
+        return STATUS_INVALID;
+
+    int stall_limit = 0;
+    if (pop_option(args, "--until-stall", value))
+        stall_limit = std::stoi(value);
+
+    int time_budget = 0;
+    if (pop_option(args, "--time-budget", value))
+        time_budget = std::stoi(value);
+
+    int checkpoint_every = 1;
+    if (pop_option(args, "--checkpoint", value))
+        checkpoint_every = std::max(1, std::stoi(value));
+
+    bool resume = pop_flag(args, "--resume");
+
+    std::string cache_dir;
+    pop_option(args, "--cache", cache_dir);
+
+    std::string seed_from;
+    pop_option(args, "--seed-from", seed_from);
+
+    std::string corpus;
+    pop_option(args, "--corpus", corpus);
+
+    bool has_decode_weight = pop_option(args, "--decode-weight", value);
+    if (has_decode_weight)
+        options.objective.decode_weight = std::stod(value);
+
     if (args.size() != 2 && args.size() != 3)
         return STATUS_INVALID;
 
@@ -323,11 +636,58 @@ static status_t cmd_rlefont_optimize(const std::vector<std::string> &args)
     if (!f)
         return STATUS_ERROR;
 
-    size_t oldsize = mcufont::rlefont::get_encoded_size(*f);
+    if (!corpus.empty())
+    {
+        if (!load_glyph_weights(corpus, *f, options.objective.glyph_weights))
+            return STATUS_ERROR;
+
+        if (!has_decode_weight)
+            options.objective.decode_weight = DEFAULT_DECODE_WEIGHT;
+    }
+
+    // Only the glyphs touched by the changes of each iteration need to be
+    // encoded again to report the size.
+    mcufont::rlefont::EncodingCache cache;
+    size_t oldsize = cache.GetEncodedSize(*f, options.fast);
 
     std::cout << "Original size is " << oldsize << " bytes" << std::endl;
+
+    // With a decode cost in the objective, the progress is measured by the
+    // objective that the optimizer minimizes instead of the size alone.
+    bool has_decode_cost = (options.objective.decode_weight > 0 ||
+                            options.objective.max_glyph_cost > 0);
+    double decode_cost = 0;
+    size_t slowest = 0;
+    auto get_objective = [&](size_t size) {
+        if (!has_decode_cost)
+            return size;
+
+        std::unique_ptr<mcufont::rlefont::encoded_font_t> e =
+            mcufont::rlefont::encode_font(*f, options.fast);
+        decode_cost = mcufont::rlefont::get_decode_cost(
+            *e, f->GetFontInfo(), options.objective.glyph_weights);
+        slowest = max_decode_cost(*e, f->GetFontInfo());
+        return mcufont::rlefont::get_objective(*f, *e, options.objective);
+    };
+
+    size_t oldobjective = get_objective(oldsize);
+    if (has_decode_cost)
+        std::cout << "Weighted decode cost is " << std::round(decode_cost)
+                  << ", slowest glyph " << slowest << std::endl;
+
+    mcufont::rlefont::optimize_state_t state;
+    if (resume)
+        resume_state(src, *f, state);
+
+    if (state.best_size == 0)
+        state.best_size = oldobjective;
+
     std::cout << "Press ctrl-C at any time to stop." << std::endl;
-    std::cout << "Results are saved automatically after each iteration." << std::endl;
+    if (checkpoint_every == 1)
+        std::cout << "Results are saved automatically after each iteration." << std::endl;
+    else
+        std::cout << "Results are saved automatically every "
+                  << checkpoint_every << " iterations." << std::endl;
 
     int limit = 100;
     if (args.size() == 3)
@@ -335,31 +695,196 @@ static status_t cmd_rlefont_optimize(const std::vector<std::string> &args)
         limit = std::stoi(args.at(2));
     }
 
+    if (options.method == mcufont::rlefont::METHOD_REPAIR)
+        limit = 1;
+
     if (limit > 0)
         std::cout << "Limit is " << limit << " iterations" << std::endl;
 
-    int i = 0;
+    if (stall_limit > 0)
+        std::cout << "Stopping after " << stall_limit
+                  << " iterations without improvement" << std::endl;
+
+    if (time_budget > 0)
+        std::cout << "Time budget is " << time_budget << " seconds" << std::endl;
+
+    // A cached dictionary for the same glyphs that has had at least as many
+    // iterations makes the run unnecessary.
+    mcufont::rlefont::DictionaryCache dictcache(cache_dir);
+    if (!cache_dir.empty() && !resume)
+    {
+        size_t size = 0;
+        if (start_from_cache(dictcache, *f, limit, options, cache, size))
+            return save_dat(src, f.get()) ? STATUS_OK : STATUS_ERROR;
+
+        if (size > 0)
+            state.best_size = get_objective(size);
+    }
+
+    if (!seed_from.empty() && !resume)
+    {
+        size_t size;
+        if (!seed_from_file(seed_from, *f, options, cache, size))
+            return STATUS_ERROR;
+
+        state.best_size = std::min(state.best_size, get_objective(size));
+    }
+
+    CheckpointWriter checkpoints(src);
+    size_t saved = state.iterations;
     time_t oldtime = time(NULL);
-    while (!limit || i < limit)
+
+    // The budget is also checked between the rounds inside optimize(), so
+    // that a long iteration does not overrun it.
+    if (time_budget > 0)
+        options.deadline = std::chrono::steady_clock::now() + std::chrono::seconds(time_budget);
+
+    while (!limit || state.iterations < (size_t)limit)
     {
-        mcufont::rlefont::optimize(*f);
+        mcufont::rlefont::optimize(*f, options, &state);
 
-        size_t newsize = mcufont::rlefont::get_encoded_size(*f);
+        size_t newsize = cache.GetEncodedSize(*f, options.fast);
         time_t newtime = time(NULL);
 
-        int bytes_per_min = (oldsize - newsize) * 60 / (newtime - oldtime + 1);
+        int bytes_per_min = ((int)oldsize - (int)newsize) * 60 / (newtime - oldtime + 1);
+
+        size_t objective = get_objective(newsize);
+
+        state.iterations++;
+        std::cout << "iteration " << state.iterations << ", size " << newsize << " bytes";
+        if (has_decode_cost)
+            std::cout << ", decode cost " << std::round(decode_cost)
+                      << ", slowest glyph " << slowest;
+        std::cout << ", speed " << bytes_per_min << " B/min" << std::endl;
 
-        i++;
-        std::cout << "iteration " << i << ", size " << newsize
-                  << " bytes, speed " << bytes_per_min << " B/min"
-                  << std::endl;
+        state.stalled = (objective < state.best_size) ? 0 : state.stalled + 1;
+        state.best_size = std::min(state.best_size, objective);
 
+        if (state.iterations % checkpoint_every == 0)
         {
-            if (!save_dat(src, f.get()))
-                return STATUS_ERROR;
+            checkpoints.Write(*f, state);
+            saved = state.iterations;
+        }
+
+        if (stall_limit > 0 && state.stalled >= (size_t)stall_limit)
+        {
+            std::cout << "No improvement in " << state.stalled
+                      << " iterations, stopping." << std::endl;
+            break;
+        }
+
+        if (time_budget > 0 && std::chrono::steady_clock::now() >= options.deadline)
+        {
+            std::cout << "Time budget used, stopping." << std::endl;
+            break;
         }
     }
 
+    if (saved != state.iterations)
+        checkpoints.Write(*f, state);
+
+    if (!checkpoints.Wait())
+        return STATUS_ERROR;
+
+    if (!cache_dir.empty() && !dictcache.Store(*f, state.iterations, options))
+        std::cerr << "Could not store the result in " << cache_dir << std::endl;
+
+    return STATUS_OK;
+}
+
+// Optimize copies of the font with different decode weights, to show how
+// much size each step down in decode cost takes.
+static status_t cmd_rlefont_tradeoff(const std::vector<std::string> &cmdline)
+{
+    std::vector<std::string> args = cmdline;
+    mcufont::rlefont::optimize_options_t options;
+    std::string value;
+
+    if (!parse_optimize_options(args, options))
+        return STATUS_INVALID;
+
+    std::string corpus;
+    pop_option(args, "--corpus", corpus);
+
+    std::vector<double> weights = {0, 0.005, 0.01, 0.02, 0.05, 0.1};
+    if (pop_option(args, "--weights", value))
+    {
+        weights.clear();
+        std::istringstream list(value);
+        std::string item;
+        while (std::getline(list, item, ','))
+            weights.push_back(std::stod(item));
+    }
+
+    if (args.size() != 3 || weights.empty())
+        return STATUS_INVALID;
+
+    std::unique_ptr<DataFile> f = load_dat(args.at(1));
+    if (!f)
+        return STATUS_ERROR;
+
+    size_t iterations = std::stoi(args.at(2));
+
+    if (!corpus.empty() &&
+        !load_glyph_weights(corpus, *f, options.objective.glyph_weights))
+    {
+        return STATUS_ERROR;
+    }
+
+    struct result_t
+    {
+        double weight;
+        size_t size;
+        double cost;
+        size_t slowest;
+    };
+
+    std::vector<result_t> results;
+    for (double weight : weights)
+    {
+        DataFile trial = *f;
+        options.objective.decode_weight = weight;
+        mcufont::encoder::optimize(trial, iterations, options);
+
+        std::unique_ptr<mcufont::rlefont::encoded_font_t> e =
+            mcufont::rlefont::encode_font(trial, false);
+        result_t r;
+        r.weight = weight;
+        r.size = mcufont::rlefont::get_encoded_size(trial, *e);
+        r.cost = mcufont::rlefont::get_decode_cost(*e, trial.GetFontInfo(),
+                                                   options.objective.glyph_weights);
+        r.slowest = max_decode_cost(*e, trial.GetFontInfo());
+        results.push_back(r);
+
+        std::cout << "Weight " << weight << ": size " << r.size
+                  << " bytes, decode cost " << std::round(r.cost)
+                  << ", slowest glyph " << r.slowest << std::endl;
+    }
+
+    // The results that no other one beats in both size and decode cost
+    // are the ones worth choosing from.
+    std::cout << std::endl << "Trade-off curve:" << std::endl;
+    std::cout << "  weight    size  decode cost  slowest glyph" << std::endl;
+    for (const result_t &r : results)
+    {
+        bool dominated = false;
+        for (const result_t &o : results)
+        {
+            if (o.size <= r.size && o.cost <= r.cost &&
+                (o.size < r.size || o.cost < r.cost))
+            {
+                dominated = true;
+            }
+        }
+
+        if (dominated)
+            continue;
+
+        std::cout << std::setw(8) << r.weight << std::setw(8) << r.size
+                  << std::setw(13) << std::round(r.cost)
+                  << std::setw(15) << r.slowest << std::endl;
+    }
+
     return STATUS_OK;
 }
 
@@ -374,8 +899,9 @@ static status_t cmd_rlefont_show_encoded(const std::vector<std::string> &args)
     if (!f)
         return STATUS_ERROR;
 
+    ThreadPool pool(ThreadPool::GetDefaultThreadCount());
     std::unique_ptr<mcufont::rlefont::encoded_font_t> e =
-        mcufont::rlefont::encode_font(*f, false);
+        mcufont::rlefont::encode_font(*f, false, pool);
 
     int i = 0;
     for (mcufont::rlefont::encoded_font_t::rlestring_t d : e->rle_dictionary)
@@ -406,8 +932,14 @@ static status_t cmd_rlefont_show_encoded(const std::vector<std::string> &args)
     return STATUS_OK;
 }
 
-static status_t cmd_bwfont_export(const std::vector<std::string> &args)
+static status_t cmd_bwfont_export(const std::vector<std::string> &cmdline)
 {
+    std::vector<std::string> args = cmdline;
+    std::string value;
+    double lookup_weight = DEFAULT_LOOKUP_WEIGHT;
+    if (pop_option(args, "--lookup-weight", value))
+        lookup_weight = std::stod(value);
+
     if (args.size() != 2 && args.size() != 3)
         return STATUS_INVALID;
 
@@ -423,9 +955,13 @@ static status_t cmd_bwfont_export(const std::vector<std::string> &args)
         std::cout << "Warning: font is not black and white" << std::endl;
     }
 
+    std::string warning = dropped_chars_warning(*f);
+    if (!warning.empty())
+        std::cout << warning << std::endl;
+
     {
         std::ofstream source(dst);
-        mcufont::bwfont::write_source(source, dst, *f);
+        mcufont::bwfont::write_source(source, dst, *f, lookup_weight);
         std::cout << "Wrote " << dst << std::endl;
     }
 
@@ -433,6 +969,54 @@ static status_t cmd_bwfont_export(const std::vector<std::string> &args)
 }
 
 
+static status_t cmd_build(const std::vector<std::string> &cmdline)
+{
+    std::vector<std::string> args = cmdline;
+    mcufont::rlefont::optimize_options_t options;
+    std::string value;
+
+    size_t threads = 0;
+    if (pop_option(args, "--threads", value))
+        threads = std::stoi(value);
+
+    if (pop_option(args, "--tasks", value))
+        options.tasks = std::stoi(value);
+
+    if (pop_flag(args, "--fast"))
+        options.fast = true;
+
+    std::string cache_dir;
+    pop_option(args, "--cache", cache_dir);
+    mcufont::rlefont::DictionaryCache dictcache(cache_dir);
+
+    if (args.size() != 2)
+        return STATUS_INVALID;
+
+    std::ifstream specfile(args.at(1));
+    if (!specfile.good())
+    {
+        std::cerr << "Could not open " << args.at(1) << std::endl;
+        return STATUS_ERROR;
+    }
+
+    std::vector<encoder::build_font_t> fonts;
+    try
+    {
+        fonts = encoder::load_build_spec(specfile);
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return STATUS_ERROR;
+    }
+
+    bool ok = encoder::build_fonts(fonts, threads, options,
+        cache_dir.empty() ? nullptr : &dictcache,
+        [](const std::string &line) { std::cout << line << std::endl; });
+
+    return ok ? STATUS_OK : STATUS_ERROR;
+}
+
 static const char *usage_msg =
     "Usage: mcufont <command> [options] ...\n"
     "Commands for importing:\n"
@@ -442,15 +1026,83 @@ static const char *usage_msg =
     "Commands for inspecting and editing data files:\n"
     "   filter <datfile> <range> ...         Remove everything except specified characters.\n"
     "   show_glyph <datfile> <index>         Show the glyph at index.\n"
+    "   convert <datfile> <outfile>          Convert between text .dat and binary .bdat.\n"
     "\n"
     "Commands specific to rlefont format:\n"
-    "   rlefont_size <datfile>               Check the encoded size of the data file.\n"
-    "   rlefont_optimize <datfile>           Perform an optimization pass on the data file.\n"
-    "   rlefont_export <datfile> [outfile]   Export to .c source code.\n"
+    "   rlefont_size <datfile> [--lookup-weight L]\n"
+    "                                        Check the encoded size of the data file.\n"
+    "   rlefont_optimize <datfile> [iterations] [--threads N] [--tasks M] [--fast]\n"
+    "                    [--method random|repair] [--adaptive]\n"
+    "                    [--until-stall N] [--time-budget S]\n"
+    "                    [--anneal T] [--cooling C]\n"
+    "                    [--islands I] [--migrate R] [--batch B]\n"
+    "                    [--sample K] [--checkpoint E] [--resume]\n"
+    "                    [--cache DIR] [--seed-from DATFILE]\n"
+    "                    [--corpus TEXTFILE] [--decode-weight W]\n"
+    "                    [--max-decode-cost C]\n"
+    "                                        Perform an optimization pass on the data file.\n"
+    "                                        Uses N threads (default all) to run M passes\n"
+    "                                        per round (default 4). The result depends\n"
+    "                                        only on the seed and M, not on N.\n"
+    "                                        --fast scores with the greedy encoder.\n"
+    "                                        --method repair rebuilds the dictionary from\n"
+    "                                        the most common pairs of codes, in one round.\n"
+    "                                        --adaptive runs more often the algorithms that\n"
+    "                                        have been finding improvements.\n"
+    "                                        Stops early after N iterations without\n"
+    "                                        improvement, or after S seconds. The time is\n"
+    "                                        checked between rounds, so the last iteration\n"
+    "                                        can be cut short.\n"
+    "                                        --anneal also keeps changes that cost n bytes,\n"
+    "                                        with probability exp(-n/T). T is multiplied\n"
+    "                                        by C (default 0.999) after each round.\n"
+    "                                        --islands evolves I dictionaries side by side,\n"
+    "                                        exchanging entries every R rounds (default 10).\n"
+    "                                        --batch tries B replacements for the worst\n"
+    "                                        entry in parallel each round, keeping the best.\n"
+    "                                        --sample scores moves on 1/K of the glyphs\n"
+    "                                        first, and verifies the promising ones.\n"
+    "                                        Saves the data file and <datfile>.state every\n"
+    "                                        E iterations (default 1). --resume continues\n"
+    "                                        from the saved state.\n"
+    "                                        --cache skips the run if DIR has a result for\n"
+    "                                        the same glyphs, or else starts from the\n"
+    "                                        closest font there, and stores the result.\n"
+    "                                        --seed-from first takes the dictionary entries\n"
+    "                                        of DATFILE that make this font smaller,\n"
+    "                                        resampled to the glyph size of this font.\n"
+    "                                        --corpus weights the glyphs by how often they\n"
+    "                                        occur in TEXTFILE, and minimizes the size plus\n"
+    "                                        W (default 0.01) times the decode cost, summed\n"
+    "                                        with those weights. The decode cost of a glyph\n"
+    "                                        is the bytes read plus 4 per pixel callback.\n"
+    "                                        --max-decode-cost pushes the cost of every\n"
+    "                                        glyph below C where it can.\n"
+    "   rlefont_tradeoff <datfile> <iterations> [--weights W1,W2,...]\n"
+    "                    [--corpus TEXTFILE] [--max-decode-cost C]\n"
+    "                    [--threads N] [--tasks M] [--fast] ...\n"
+    "                                        Optimize with each decode weight and show\n"
+    "                                        the size against the decode cost. The data\n"
+    "                                        file is not changed. Also takes --method,\n"
+    "                                        --adaptive, --anneal, --cooling, --islands,\n"
+    "                                        --migrate, --batch and --sample as for\n"
+    "                                        rlefont_optimize.\n"
+    "   rlefont_export <datfile> [outfile] [--lookup-weight L]\n"
+    "                                        Export to .c source code. The characters are\n"
+    "                                        divided into ranges so that the table size\n"
+    "                                        plus L (default 16) bytes per range is least.\n"
     "   rlefont_show_encoded <datfile>       Show the encoded data for debugging.\n"
     "\n"
     "Commands specific to bwfont format:\n"
-    "   bwfont_export <datfile> [outfile]    Export to .c source code.\n"
+    "   bwfont_export <datfile> [outfile] [--lookup-weight L]\n"
+    "                                        Export to .c source code, with ranges as for\n"
+    "                                        rlefont_export.\n"
+    "\n"
+    "Commands for building many fonts:\n"
+    "   build <specfile> [--threads N] [--tasks M] [--fast] [--cache DIR]\n"
+    "                                        Import, filter, optimize and export the\n"
+    "                                        fonts listed in the spec file, in parallel.\n"
+    "                                        See fonts/fonts.build for the format.\n"
     "";
 
 typedef status_t (*cmd_t)(const std::vector<std::string> &args);
@@ -458,12 +1110,15 @@ static const std::map<std::string, cmd_t> command_list {
     {"import_ttf",              cmd_import_ttf},
     {"import_bdf",              cmd_import_bdf},
     {"filter",                  cmd_filter},
+    {"convert",                 cmd_convert},
     {"show_glyph",              cmd_show_glyph},
     {"rlefont_size",            cmd_rlefont_size},
     {"rlefont_optimize",        cmd_rlefont_optimize},
+    {"rlefont_tradeoff",        cmd_rlefont_tradeoff},
     {"rlefont_export",          cmd_rlefont_export},
     {"rlefont_show_encoded",    cmd_rlefont_show_encoded},
     {"bwfont_export",           cmd_bwfont_export},
+    {"build",                   cmd_build},
 };
 
 int main(int argc, char **argv)
@@ -1,17 +1,23 @@
 #include "optimize_rlefont.hh"
 #include "encode_rlefont.hh"
+#include "threadpool.hh"
 #include <random>
+#include <cmath>
 #include <iostream>
 #include <set>
-#include <thread>
 #include <algorithm>
+#include <numeric>
+#include <queue>
+#include <map>
+#include <unordered_map>
+#include <sstream>
+#include <iomanip>
+#include <limits>
 #include "ccfixes.hh"
 
 namespace mcufont {
 namespace rlefont {
 
-typedef std::mt19937 rnd_t;
-
 // Select a random substring among all the glyphs in the datafile.
 std::unique_ptr<DataFile::pixels_t> random_substring(const DataFile &datafile, rnd_t &rnd)
 {
@@ -32,24 +38,76 @@ std::unique_ptr<DataFile::pixels_t> random_substring(const DataFile &datafile, r
     return result;
 }
 
+// Compute the encoded size with dictionary entry at index replaced by d.
+// The entry is changed in place and reverted afterwards, so that the
+// datafile does not need to be copied for each trial.
+static size_t evaluate_entry(DataFile &datafile, IncrementalEvaluator &evaluator,
+                             size_t index, const DataFile::dictentry_t &d)
+{
+    DataFile::undolog_t undolog;
+    datafile.SetDictionaryEntry(index, d, undolog);
+    size_t newsize = evaluator.Evaluate(datafile, index);
+    datafile.Undo(undolog);
+    return newsize;
+}
+
+// Compute the encoded size for a move of the optimizer, like
+// evaluate_entry(). If the evaluator has a glyph sample, the move is first
+// scored on the sample only, and encoded for real only if it looks no worse
+// than the current size or below the limit for keeping it. Other moves get
+// the largest size, so that they are never accepted without being verified.
+static size_t evaluate_move(DataFile &datafile, IncrementalEvaluator &evaluator,
+                            size_t index, const DataFile::dictentry_t &d,
+                            double limit)
+{
+    if (!evaluator.HasSample())
+        return evaluate_entry(datafile, evaluator, index, d);
+
+    DataFile::undolog_t undolog;
+    datafile.SetDictionaryEntry(index, d, undolog);
+    size_t newsize = evaluator.Estimate(datafile, index);
+    if (newsize < limit || newsize <= evaluator.GetEncodedSize())
+        newsize = evaluator.Evaluate(datafile, index);
+    else
+        newsize = std::numeric_limits<size_t>::max();
+    datafile.Undo(undolog);
+    return newsize;
+}
+
+// Decide how large the font may get from a change that is kept, when it is
+// now size bytes: a change is kept if it gives a size below the limit.
+// Improvements are always kept. At a temperature above zero, a change that
+// makes the font n bytes larger is kept with probability exp(-n / T), as in
+// simulated annealing, which lets the search climb out of local minima. The
+// random number is drawn before the change is evaluated, so that a sampled
+// estimate can be checked against the same limit.
+static double get_size_limit(size_t size, double temperature, rnd_t &rnd)
+{
+    if (temperature <= 0)
+        return size;
+
+    std::uniform_real_distribution<double> dist(0, 1);
+    return size - temperature * std::log(dist(rnd));
+}
+
 // Try to replace the worst dictionary entry with a better one.
-void optimize_worst(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose)
+void optimize_worst(DataFile &datafile, IncrementalEvaluator &evaluator,
+    size_t &size, rnd_t &rnd, double temperature, bool verbose)
 {
     std::uniform_int_distribution<size_t> dist(0, 1);
 
-    DataFile trial = datafile;
-    size_t worst = trial.GetLowScoreIndex();
-    DataFile::dictentry_t d = trial.GetDictionaryEntry(worst);
+    size_t worst = datafile.GetLowScoreIndex();
+    DataFile::dictentry_t d = datafile.GetDictionaryEntry(worst);
     d.replacement = *random_substring(datafile, rnd);
     d.ref_encode = dist(rnd);
-    trial.SetDictionaryEntry(worst, d);
-
-    size_t newsize = get_encoded_size(trial);
+    double limit = get_size_limit(size, temperature, rnd);
+    size_t newsize = evaluate_move(datafile, evaluator, worst, d, limit);
 
-    if (newsize < size)
+    if (newsize < limit)
     {
-        d.score = size - newsize;
+        d.score = (int)size - (int)newsize;
         datafile.SetDictionaryEntry(worst, d);
+        evaluator.Update(datafile, worst);
         size = newsize;
 
         if (verbose)
@@ -59,21 +117,21 @@ void optimize_worst(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose)
 }
 
 // Try to replace random dictionary entry with another one.
-void optimize_any(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose)
+void optimize_any(DataFile &datafile, IncrementalEvaluator &evaluator,
+    size_t &size, rnd_t &rnd, double temperature, bool verbose)
 {
-    DataFile trial = datafile;
     std::uniform_int_distribution<size_t> dist(0, DataFile::dictionarysize - 1);
     size_t index = dist(rnd);
-    DataFile::dictentry_t d = trial.GetDictionaryEntry(index);
+    DataFile::dictentry_t d = datafile.GetDictionaryEntry(index);
     d.replacement = *random_substring(datafile, rnd);
-    trial.SetDictionaryEntry(index, d);
+    double limit = get_size_limit(size, temperature, rnd);
+    size_t newsize = evaluate_move(datafile, evaluator, index, d, limit);
 
-    size_t newsize = get_encoded_size(trial);
-
-    if (newsize < size)
+    if (newsize < limit)
     {
-        d.score = size - newsize;
+        d.score = (int)size - (int)newsize;
         datafile.SetDictionaryEntry(index, d);
+        evaluator.Update(datafile, index);
         size = newsize;
 
         if (verbose)
@@ -83,12 +141,12 @@ void optimize_any(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose)
 }
 
 // Try to append or prepend random dictionary entry.
-void optimize_expand(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose, bool binary_only)
+void optimize_expand(DataFile &datafile, IncrementalEvaluator &evaluator,
+    size_t &size, rnd_t &rnd, double temperature, bool verbose, bool binary_only)
 {
-    DataFile trial = datafile;
     std::uniform_int_distribution<size_t> dist1(0, DataFile::dictionarysize - 1);
     size_t index = dist1(rnd);
-    DataFile::dictentry_t d = trial.GetDictionaryEntry(index);
+    DataFile::dictentry_t d = datafile.GetDictionaryEntry(index);
 
     std::uniform_int_distribution<size_t> dist3(1, 3);
     size_t count = dist3(rnd);
@@ -120,14 +178,14 @@ void optimize_expand(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose,
         }
     }
 
-    trial.SetDictionaryEntry(index, d);
+    double limit = get_size_limit(size, temperature, rnd);
+    size_t newsize = evaluate_move(datafile, evaluator, index, d, limit);
 
-    size_t newsize = get_encoded_size(trial);
-
-    if (newsize < size)
+    if (newsize < limit)
     {
-        d.score = size - newsize;
+        d.score = (int)size - (int)newsize;
         datafile.SetDictionaryEntry(index, d);
+        evaluator.Update(datafile, index);
         size = newsize;
 
         if (verbose)
@@ -137,12 +195,12 @@ void optimize_expand(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose,
 }
 
 // Try to trim random dictionary entry.
-void optimize_trim(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose)
+void optimize_trim(DataFile &datafile, IncrementalEvaluator &evaluator,
+    size_t &size, rnd_t &rnd, double temperature, bool verbose)
 {
-    DataFile trial = datafile;
     std::uniform_int_distribution<size_t> dist1(0, DataFile::dictionarysize - 1);
     size_t index = dist1(rnd);
-    DataFile::dictentry_t d = trial.GetDictionaryEntry(index);
+    DataFile::dictentry_t d = datafile.GetDictionaryEntry(index);
 
     if (d.replacement.size() <= 2) return;
 
@@ -160,14 +218,14 @@ void optimize_trim(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose)
         d.replacement.erase(d.replacement.end() - end, d.replacement.end() - 1);
     }
 
-    trial.SetDictionaryEntry(index, d);
+    double limit = get_size_limit(size, temperature, rnd);
+    size_t newsize = evaluate_move(datafile, evaluator, index, d, limit);
 
-    size_t newsize = get_encoded_size(trial);
-
-    if (newsize < size)
+    if (newsize < limit)
     {
-        d.score = size - newsize;
+        d.score = (int)size - (int)newsize;
         datafile.SetDictionaryEntry(index, d);
+        evaluator.Update(datafile, index);
         size = newsize;
 
         if (verbose)
@@ -178,23 +236,23 @@ void optimize_trim(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose)
 }
 
 // Switch random dictionary entry to use ref encoding or back to rle.
-void optimize_refdict(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose)
+void optimize_refdict(DataFile &datafile, IncrementalEvaluator &evaluator,
+    size_t &size, rnd_t &rnd, double temperature, bool verbose)
 {
-    DataFile trial = datafile;
     std::uniform_int_distribution<size_t> dist1(0, DataFile::dictionarysize - 1);
     size_t index = dist1(rnd);
-    DataFile::dictentry_t d = trial.GetDictionaryEntry(index);
+    DataFile::dictentry_t d = datafile.GetDictionaryEntry(index);
 
     d.ref_encode = !d.ref_encode;
 
-    trial.SetDictionaryEntry(index, d);
-
-    size_t newsize = get_encoded_size(trial);
+    double limit = get_size_limit(size, temperature, rnd);
+    size_t newsize = evaluate_move(datafile, evaluator, index, d, limit);
 
-    if (newsize < size)
+    if (newsize < limit)
     {
-        d.score = size - newsize;
+        d.score = (int)size - (int)newsize;
         datafile.SetDictionaryEntry(index, d);
+        evaluator.Update(datafile, index);
         size = newsize;
 
         if (verbose)
@@ -205,9 +263,9 @@ void optimize_refdict(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose
 }
 
 // Combine two random dictionary entries.
-void optimize_combine(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose)
+void optimize_combine(DataFile &datafile, IncrementalEvaluator &evaluator,
+    size_t &size, rnd_t &rnd, double temperature, bool verbose)
 {
-    DataFile trial = datafile;
     std::uniform_int_distribution<size_t> dist1(0, DataFile::dictionarysize - 1);
     size_t worst = datafile.GetLowScoreIndex();
     size_t index1 = dist1(rnd);
@@ -220,14 +278,14 @@ void optimize_combine(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose
     d.replacement = part1;
     d.replacement.insert(d.replacement.end(), part2.begin(), part2.end());
     d.ref_encode = true;
-    trial.SetDictionaryEntry(worst, d);
-
-    size_t newsize = get_encoded_size(trial);
+    double limit = get_size_limit(size, temperature, rnd);
+    size_t newsize = evaluate_move(datafile, evaluator, worst, d, limit);
 
-    if (newsize < size)
+    if (newsize < limit)
     {
-        d.score = size - newsize;
+        d.score = (int)size - (int)newsize;
         datafile.SetDictionaryEntry(worst, d);
+        evaluator.Update(datafile, worst);
         size = newsize;
 
         if (verbose)
@@ -237,45 +295,60 @@ void optimize_combine(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose
     }
 }
 
-// Pick a random part of an encoded glyph and encode it as a ref dict.
-void optimize_encpart(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose)
+// Select a random run of references in an encoded glyph, and return the
+// pixels that it covers. Returns nullptr if the glyph has less than two
+// references.
+std::unique_ptr<DataFile::pixels_t> random_encoded_part(const DataFile &datafile,
+    const IncrementalEvaluator &evaluator, rnd_t &rnd)
 {
-    std::unique_ptr<encoded_font_t> e = encode_font(datafile);
+    std::unique_ptr<DataFile::pixels_t> result;
 
     // Pick a random encoded glyph
     std::uniform_int_distribution<size_t> dist1(0, datafile.GetGlyphCount() - 1);
     size_t index = dist1(rnd);
-    const encoded_font_t::refstring_t &refstr = e->glyphs.at(index);
+    std::vector<size_t> parts = evaluator.GetGlyphParts(datafile, index);
 
-    if (refstr.size() < 2)
-        return;
+    if (parts.size() < 2)
+        return result;
 
     // Pick a random part of it
-    std::uniform_int_distribution<size_t> dist2(2, refstr.size());
+    std::uniform_int_distribution<size_t> dist2(2, parts.size());
     size_t length = dist2(rnd);
-    std::uniform_int_distribution<size_t> dist3(0, refstr.size() - length);
+    std::uniform_int_distribution<size_t> dist3(0, parts.size() - length);
     size_t start = dist3(rnd);
 
-    // Decode that part
-    encoded_font_t::refstring_t substr(refstr.begin() + start,
-                                       refstr.begin() + start + length);
-    std::unique_ptr<DataFile::pixels_t> decoded =
-        decode_glyph(*e, substr, datafile.GetFontInfo());
+    // Find the pixels that the part covers
+    size_t first = std::accumulate(parts.begin(), parts.begin() + start, size_t(0));
+    size_t count = std::accumulate(parts.begin() + start,
+                                   parts.begin() + start + length, size_t(0));
+    const DataFile::pixels_t &pixels = datafile.GetGlyphEntry(index).data;
+    result.reset(new DataFile::pixels_t(pixels.begin() + first,
+                                        pixels.begin() + first + count));
+    return result;
+}
+
+// Pick a random part of an encoded glyph and encode it as a ref dict.
+void optimize_encpart(DataFile &datafile, IncrementalEvaluator &evaluator,
+    size_t &size, rnd_t &rnd, double temperature, bool verbose)
+{
+    std::unique_ptr<DataFile::pixels_t> part = random_encoded_part(datafile, evaluator, rnd);
+
+    if (!part)
+        return;
 
     // Add that as a new dictionary entry
-    DataFile trial = datafile;
-    size_t worst = trial.GetLowScoreIndex();
-    DataFile::dictentry_t d = trial.GetDictionaryEntry(worst);
-    d.replacement = *decoded;
+    size_t worst = datafile.GetLowScoreIndex();
+    DataFile::dictentry_t d = datafile.GetDictionaryEntry(worst);
+    d.replacement = *part;
     d.ref_encode = true;
-    trial.SetDictionaryEntry(worst, d);
+    double limit = get_size_limit(size, temperature, rnd);
+    size_t newsize = evaluate_move(datafile, evaluator, worst, d, limit);
 
-    size_t newsize = get_encoded_size(trial);
-
-    if (newsize < size)
+    if (newsize < limit)
     {
-        d.score = size - newsize;
+        d.score = (int)size - (int)newsize;
         datafile.SetDictionaryEntry(worst, d);
+        evaluator.Update(datafile, worst);
         size = newsize;
 
         if (verbose)
@@ -284,134 +357,1520 @@ void optimize_encpart(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose
     }
 }
 
-// Execute all the optimization algorithms once.
-void optimize_pass(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose)
+void run_operator(size_t op, DataFile &datafile, IncrementalEvaluator &evaluator,
+    size_t &size, rnd_t &rnd, double temperature, bool verbose)
 {
-    optimize_worst(datafile, size, rnd, verbose);
-    optimize_any(datafile, size, rnd, verbose);
-    optimize_expand(datafile, size, rnd, verbose, false);
-    optimize_expand(datafile, size, rnd, verbose, true);
-    optimize_trim(datafile, size, rnd, verbose);
-    optimize_refdict(datafile, size, rnd, verbose);
-    optimize_combine(datafile, size, rnd, verbose);
-    optimize_encpart(datafile, size, rnd, verbose);
+    switch (op)
+    {
+        case 0: optimize_worst(datafile, evaluator, size, rnd, temperature, verbose); break;
+        case 1: optimize_any(datafile, evaluator, size, rnd, temperature, verbose); break;
+        case 2: optimize_expand(datafile, evaluator, size, rnd, temperature, verbose, false); break;
+        case 3: optimize_expand(datafile, evaluator, size, rnd, temperature, verbose, true); break;
+        case 4: optimize_trim(datafile, evaluator, size, rnd, temperature, verbose); break;
+        case 5: optimize_refdict(datafile, evaluator, size, rnd, temperature, verbose); break;
+        case 6: optimize_combine(datafile, evaluator, size, rnd, temperature, verbose); break;
+        case 7: optimize_encpart(datafile, evaluator, size, rnd, temperature, verbose); break;
+    }
+}
+
+// Bytes saved and number of tries for each operator during a pass.
+struct pass_stats_t
+{
+    std::vector<size_t> saved = std::vector<size_t>(operator_count);
+    std::vector<size_t> tries = std::vector<size_t>(operator_count);
+};
+
+// Execute the optimization algorithms operator_count times. Without weights
+// each of them runs once in a fixed order, otherwise they are picked at
+// random with the given weights.
+void optimize_pass(DataFile &datafile, IncrementalEvaluator &evaluator,
+    size_t &size, rnd_t &rnd, double temperature, bool verbose,
+    const std::vector<double> &weights, pass_stats_t &stats)
+{
+    std::discrete_distribution<size_t> dist(weights.begin(), weights.end());
+
+    for (size_t i = 0; i < operator_count; i++)
+    {
+        size_t op = weights.empty() ? i : dist(rnd);
+        size_t oldsize = size;
+        run_operator(op, datafile, evaluator, size, rnd, temperature, verbose);
+        if (size < oldsize)
+            stats.saved.at(op) += oldsize - size;
+        stats.tries.at(op)++;
+    }
 }
 
 // Execute multiple passes in parallel and take the one with the best result.
-// The amount of parallelism is hardcoded in order to retain deterministic
-// behaviour.
-void optimize_parallel(DataFile &datafile, size_t &size, rnd_t &rnd, bool verbose, int num_threads = 4)
+// Each task gets its own random seed, drawn in task order from the main
+// generator, and ties go to the lowest task index. This keeps the result
+// independent of how many threads the pool actually has. The statistics of
+// all the tasks are summed into stats.
+void optimize_parallel(DataFile &datafile, IncrementalEvaluator &evaluator,
+    size_t &size, rnd_t &rnd, double temperature, bool verbose,
+    ThreadPool &pool, size_t num_tasks,
+    const std::vector<double> &weights, pass_stats_t &stats)
 {
     std::vector<DataFile> datafiles;
+    std::vector<IncrementalEvaluator> evaluators;
     std::vector<size_t> sizes;
     std::vector<rnd_t> rnds;
-    std::vector<std::unique_ptr<std::thread> > threads;
+    std::vector<pass_stats_t> task_stats(num_tasks);
 
-    for (int i = 0; i < num_threads; i++)
+    for (size_t i = 0; i < num_tasks; i++)
     {
         datafiles.emplace_back(datafile);
+        evaluators.emplace_back(evaluator);
         sizes.emplace_back(size);
         rnds.emplace_back(rnd());
     }
 
-    for (int i = 0; i < num_threads; i++)
+    pool.Run(num_tasks, [&](size_t i) {
+        optimize_pass(datafiles.at(i), evaluators.at(i),
+                      sizes.at(i), rnds.at(i), temperature, verbose,
+                      weights, task_stats.at(i));
+    });
+
+    for (const pass_stats_t &t : task_stats)
     {
-        threads.emplace_back(new std::thread(optimize_pass,
-                                             std::ref(datafiles.at(i)),
-                                             std::ref(sizes.at(i)),
-                                             std::ref(rnds.at(i)),
-                                             verbose));
+        for (size_t op = 0; op < operator_count; op++)
+        {
+            stats.saved.at(op) += t.saved.at(op);
+            stats.tries.at(op) += t.tries.at(op);
+        }
     }
 
-    for (int i = 0; i < num_threads; i++)
+    size_t best = std::min_element(sizes.begin(), sizes.end()) - sizes.begin();
+    size = sizes.at(best);
+    datafile = datafiles.at(best);
+    evaluator = evaluators.at(best);
+}
+
+std::vector<DataFile::dictentry_t> get_batch_candidates(const DataFile &datafile,
+    const IncrementalEvaluator &evaluator, rnd_t &rnd, size_t batch)
+{
+    std::uniform_int_distribution<size_t> booldist(0, 1);
+    std::vector<DataFile::dictentry_t> candidates;
+    while (candidates.size() < batch)
     {
-        threads.at(i)->join();
+        DataFile::dictentry_t d;
+        std::unique_ptr<DataFile::pixels_t> part;
+        if (booldist(rnd))
+        {
+            part = random_encoded_part(datafile, evaluator, rnd);
+            d.ref_encode = true;
+        }
+        else
+        {
+            part = random_substring(datafile, rnd);
+            d.ref_encode = booldist(rnd);
+        }
+
+        if (part)
+        {
+            d.replacement = *part;
+            candidates.push_back(d);
+        }
     }
 
-    int best = std::min_element(sizes.begin(), sizes.end()) - sizes.begin();
+    return candidates;
+}
+
+void optimize_batch(DataFile &datafile, IncrementalEvaluator &evaluator,
+    size_t &size, rnd_t &rnd, bool verbose, ThreadPool &pool, size_t batch,
+    std::vector<DataFile> &datafiles, std::vector<IncrementalEvaluator> &evaluators)
+{
+    size_t worst = datafile.GetLowScoreIndex();
+    std::vector<DataFile::dictentry_t> candidates =
+        get_batch_candidates(datafile, evaluator, rnd, batch);
+
+    // Thread 0 uses the caller's state.
+    size_t num_tasks = datafiles.size() + 1;
+    std::vector<size_t> sizes(batch);
+    pool.Run(num_tasks, [&](size_t t) {
+        DataFile &df = (t == 0) ? datafile : datafiles.at(t - 1);
+        IncrementalEvaluator &ev = (t == 0) ? evaluator : evaluators.at(t - 1);
+        for (size_t i = t; i < batch; i += num_tasks)
+            sizes.at(i) = evaluate_move(df, ev, worst, candidates.at(i), size);
+    });
+
+    size_t best = std::min_element(sizes.begin(), sizes.end()) - sizes.begin();
+    if (sizes.at(best) >= size)
+        return;
+
+    DataFile::dictentry_t d = candidates.at(best);
+    d.score = size - sizes.at(best);
     size = sizes.at(best);
-    datafile = datafiles.at(best);
+    pool.Run(num_tasks, [&](size_t t) {
+        DataFile &df = (t == 0) ? datafile : datafiles.at(t - 1);
+        IncrementalEvaluator &ev = (t == 0) ? evaluator : evaluators.at(t - 1);
+        df.SetDictionaryEntry(worst, d);
+        ev.Update(df, worst);
+    });
+
+    if (verbose)
+        std::cout << "optimize_batch: replaced " << worst
+                  << " with candidate " << best << " of " << batch
+                  << ", score " << d.score << std::endl;
+}
+
+// Update the average savings of each operator with the results of a round,
+// letting the older rounds fade out.
+static void update_operator_stats(optimize_state_t &state, const pass_stats_t &round)
+{
+    const double decay = 0.9;
+
+    state.savings.resize(operator_count, 0);
+    for (size_t op = 0; op < operator_count; op++)
+    {
+        if (round.tries.at(op) == 0)
+            continue;
+
+        double savings = (double)round.saved.at(op) / round.tries.at(op);
+        state.savings.at(op) = decay * state.savings.at(op) + (1 - decay) * savings;
+    }
+}
+
+// Turn the average savings into weights for picking the operators. Each
+// operator gets at least a small share, so that the ones that have stopped
+// finding anything are still tried now and then.
+static std::vector<double> get_operator_weights(const optimize_state_t &state)
+{
+    const double min_share = 0.05;
+
+    std::vector<double> weights(operator_count, 1.0 / operator_count);
+    double total = std::accumulate(state.savings.begin(), state.savings.end(), 0.0);
+    if (total <= 0)
+        return weights;
+
+    for (size_t op = 0; op < operator_count; op++)
+    {
+        weights.at(op) = min_share +
+            (1 - operator_count * min_share) * state.savings.at(op) / total;
+    }
+
+    return weights;
 }
 
 // Go through all the dictionary entries and check what it costs to remove
 // them. Removes any entries with negative or zero score.
-void update_scores(DataFile &datafile, bool verbose)
+// Each thread scores one entry at a time on its own copy of the state, and
+// the results are applied in entry order. When a non-empty entry gets
+// dropped, the rest of that batch was scored against the old dictionary and
+// is done again, so the result is the same as scoring entries one by one.
+void update_scores(DataFile &datafile, IncrementalEvaluator &evaluator,
+    bool verbose, ThreadPool &pool)
+{
+    size_t oldsize = evaluator.GetEncodedSize();
+    size_t num_threads = pool.GetThreadCount();
+
+    // Thread 0 uses the caller's state, the others work on copies that
+    // catch up with the dropped entries before each batch.
+    std::vector<DataFile> datafiles;
+    std::vector<IncrementalEvaluator> evaluators;
+    std::vector<size_t> synced;
+    std::vector<size_t> dropped;
+    for (size_t t = 1; t < num_threads; t++)
+    {
+        datafiles.emplace_back(datafile);
+        evaluators.emplace_back(evaluator);
+        synced.emplace_back(0);
+    }
+
+    size_t first = 0;
+    while (first < DataFile::dictionarysize)
+    {
+        size_t count = std::min(num_threads, DataFile::dictionarysize - first);
+        std::vector<size_t> sizes(count);
+
+        pool.Run(count, [&](size_t t) {
+            DataFile &df = (t == 0) ? datafile : datafiles.at(t - 1);
+            IncrementalEvaluator &ev = (t == 0) ? evaluator : evaluators.at(t - 1);
+
+            if (t != 0)
+            {
+                for (; synced.at(t - 1) < dropped.size(); synced.at(t - 1)++)
+                {
+                    size_t index = dropped.at(synced.at(t - 1));
+                    df.SetDictionaryEntry(index, DataFile::dictentry_t());
+                    ev.Update(df, index);
+                }
+            }
+
+            DataFile::dictentry_t dummy = {};
+            sizes.at(t) = evaluate_entry(df, ev, first + t, dummy);
+        });
+
+        size_t start = first;
+        first += count;
+
+        for (size_t i = start; i < start + count; i++)
+        {
+            DataFile::dictentry_t dummy = {};
+            DataFile::dictentry_t d = datafile.GetDictionaryEntry(i);
+            d.score = sizes.at(i - start) - oldsize;
+
+            if (d.score > 0)
+            {
+                datafile.SetDictionaryEntry(i, d);
+            }
+            else
+            {
+                datafile.SetDictionaryEntry(i, dummy);
+
+                if (verbose && d.replacement.size() != 0)
+                    std::cout << "update_scores: dropped " << i
+                            << " score " << -d.score << std::endl;
+
+                if (d.replacement.size() != 0)
+                {
+                    evaluator.Update(datafile, i);
+                    dropped.push_back(i);
+                    first = i + 1;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Suffix array over the pixel strings of all glyphs, for finding the
+// substrings that occur more than once. The glyphs are concatenated with a
+// separator of a different value after each, so that no repeated substring
+// crosses from one glyph to another.
+class SuffixArray
+{
+public:
+    explicit SuffixArray(const DataFile &datafile);
+
+    // A substring that occurs count times, starting at the positions of
+    // the suffixes first ... first + count - 1 in the sorted order.
+    struct repeat_t
+    {
+        size_t start;
+        size_t length;
+        size_t first;
+        size_t count;
+    };
+
+    // Call func for every repeated substring that can't be extended to the
+    // right without losing some of its occurrences.
+    void ForEachRepeat(const std::function<void(const repeat_t&)> &func) const;
+
+    // Get the positions of all the occurrences of a repeat, in text order.
+    std::vector<size_t> GetPositions(const repeat_t &repeat) const;
+
+    // Get the concatenated pixel data. The separators are values above 15.
+    const std::vector<uint32_t> &GetText() const { return m_text; }
+
+private:
+    std::vector<uint32_t> m_text;
+    std::vector<uint32_t> m_suffixes;
+    std::vector<uint32_t> m_lcp; // Common prefix with the previous suffix.
+};
+
+SuffixArray::SuffixArray(const DataFile &datafile)
+{
+    for (size_t i = 0; i < datafile.GetGlyphCount(); i++)
+    {
+        const DataFile::pixels_t &pixels = datafile.GetGlyphEntry(i).data;
+        m_text.insert(m_text.end(), pixels.begin(), pixels.end());
+        m_text.push_back(16 + i);
+    }
+
+    // Sort the suffixes by prefix doubling: the order by the first k values
+    // gives the order by the first 2k values, when the rank of the suffix
+    // k positions later is used as the secondary key.
+    size_t n = m_text.size();
+    std::vector<uint32_t> rank(m_text), tmp(n);
+    std::vector<size_t> counts(std::max<size_t>(n, m_text.back() + 1) + 1);
+    m_suffixes.resize(n);
+
+    // Stable counting sort of the suffixes in tmp by their rank.
+    auto sort_by_rank = [&]() {
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < n; i++)
+            counts[rank[i] + 1]++;
+        std::partial_sum(counts.begin(), counts.end(), counts.begin());
+        for (size_t i = 0; i < n; i++)
+            m_suffixes[counts[rank[tmp[i]]]++] = tmp[i];
+    };
+
+    std::iota(tmp.begin(), tmp.end(), 0);
+    sort_by_rank();
+
+    for (size_t k = 1; ; k *= 2)
+    {
+        // Order by the secondary key, the suffixes shorter than k first.
+        size_t j = 0;
+        for (size_t i = n - std::min(k, n); i < n; i++)
+            tmp[j++] = i;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (m_suffixes[i] >= k)
+                tmp[j++] = m_suffixes[i] - k;
+        }
+
+        sort_by_rank();
+
+        tmp[m_suffixes[0]] = 0;
+        for (size_t i = 1; i < n; i++)
+        {
+            size_t a = m_suffixes[i - 1], b = m_suffixes[i];
+            bool same = rank[a] == rank[b] && a + k < n && b + k < n &&
+                        rank[a + k] == rank[b + k];
+            tmp[b] = tmp[a] + (same ? 0 : 1);
+        }
+        rank.swap(tmp);
+
+        if (rank[m_suffixes[n - 1]] == n - 1)
+            break;
+    }
+
+    // Kasai's algorithm: going through the suffixes in text order, the
+    // common prefix shrinks by at most one on each step.
+    m_lcp.assign(n, 0);
+    size_t h = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (rank[i] == 0)
+        {
+            h = 0;
+            continue;
+        }
+
+        size_t j = m_suffixes[rank[i] - 1];
+        while (i + h < n && j + h < n && m_text[i + h] == m_text[j + h])
+            h++;
+        m_lcp[rank[i]] = h;
+
+        if (h > 0)
+            h--;
+    }
+}
+
+void SuffixArray::ForEachRepeat(const std::function<void(const repeat_t&)> &func) const
+{
+    // Each repeat is a range of suffixes whose common prefix is longer than
+    // the ones with the neighbouring suffixes. The ranges nest, so they are
+    // found with a stack of (prefix length, first suffix) pairs.
+    std::vector<std::pair<size_t, size_t> > stack;
+    stack.push_back(std::make_pair(0, 0));
+
+    for (size_t i = 1; i <= m_suffixes.size(); i++)
+    {
+        size_t lcp = (i < m_suffixes.size()) ? m_lcp[i] : 0;
+        size_t first = i - 1;
+        while (lcp < stack.back().first)
+        {
+            first = stack.back().second;
+
+            repeat_t r;
+            r.start = m_suffixes[first];
+            r.length = stack.back().first;
+            r.first = first;
+            r.count = i - first;
+            stack.pop_back();
+            func(r);
+        }
+
+        if (lcp > stack.back().first)
+            stack.push_back(std::make_pair(lcp, first));
+    }
+}
+
+std::vector<size_t> SuffixArray::GetPositions(const repeat_t &repeat) const
+{
+    std::vector<size_t> result(m_suffixes.begin() + repeat.first,
+                               m_suffixes.begin() + repeat.first + repeat.count);
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+// Fill the dictionary with repeated substrings of the glyphs. The candidates
+// are the repeats found with a suffix array, and the runs of black or white.
+// They are ordered by their estimated savings over the way the glyphs are
+// encoded with the entries picked so far, and the best one is then checked
+// by encoding the glyphs for real.
+void init_dictionary(DataFile &datafile)
 {
-    size_t oldsize = get_encoded_size(datafile);
+    if (datafile.GetGlyphCount() == 0)
+        return;
 
     for (size_t i = 0; i < DataFile::dictionarysize; i++)
+        datafile.SetDictionaryEntry(i, DataFile::dictentry_t());
+
+    SuffixArray suffixarray(datafile);
+    const std::vector<uint32_t> &text = suffixarray.GetText();
+
+    std::vector<size_t> glyph_starts(1, 0);
+    for (size_t i = 0; i + 1 < text.size(); i++)
     {
-        DataFile trial = datafile;
-        DataFile::dictentry_t dummy = {};
-        trial.SetDictionaryEntry(i, dummy);
-        size_t newsize = get_encoded_size(trial);
+        if (text[i] > 15)
+            glyph_starts.push_back(i + 1);
+    }
 
-        DataFile::dictentry_t d = datafile.GetDictionaryEntry(i);
-        d.score = newsize - oldsize;
+    auto get_glyph = [&](size_t pos) {
+        return std::upper_bound(glyph_starts.begin(), glyph_starts.end(), pos)
+               - glyph_starts.begin() - 1;
+    };
+
+    // Share of a reference that each pixel takes in the encoding. The glyphs
+    // are encoded only once, after that each picked entry is assumed to be
+    // used in the places where it was estimated to save space. The shares
+    // are summed from the start of each glyph, so that costs[end] -
+    // costs[start] is the number of references for the pixels in between.
+    IncrementalEvaluator evaluator(datafile, false);
+    std::vector<double> shares(text.size());
+    std::vector<double> costs(text.size() + 1);
+    auto sum_costs = [&](size_t glyph) {
+        for (size_t pos = glyph_starts.at(glyph); text[pos] < 16; pos++)
+            costs[pos + 1] = costs[pos] + shares[pos];
+    };
+
+    for (size_t i = 0; i < datafile.GetGlyphCount(); i++)
+    {
+        size_t pos = glyph_starts.at(i);
+        for (size_t length : evaluator.GetGlyphParts(datafile, i))
+        {
+            std::fill(shares.begin() + pos, shares.begin() + pos + length, 1.0 / length);
+            pos += length;
+        }
+        sum_costs(i);
+    }
 
-        if (d.score > 0)
+    // Runs of black and white. Zeros at the end of a glyph are covered by
+    // REF_FILLZEROS, so they are left out.
+    std::vector<std::pair<size_t, size_t> > runs[2];
+    std::map<size_t, size_t> run_starts[2];
+    std::vector<size_t> run_ends(text.size());
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        size_t end = pos;
+        while (end < text.size() && text[end] == text[pos])
+            end++;
+
+        std::fill(run_ends.begin() + pos, run_ends.begin() + end, end);
+
+        if (text[pos] == 15 || (text[pos] == 0 && text[end] < 16))
         {
-            datafile.SetDictionaryEntry(i, d);
+            int white = (text[pos] == 15);
+            runs[white].push_back(std::make_pair(pos, end - pos));
+            run_starts[white][end - pos] = pos;
+        }
+
+        pos = end;
+    }
+
+    // Candidates are stored as repeats. For the runs, count is 0 and the
+    // places are taken from the list of runs instead of the suffix array.
+    typedef std::pair<int, size_t> candidate_t;
+    std::vector<SuffixArray::repeat_t> repeats;
+    std::priority_queue<candidate_t> candidates;
+
+    // Places where the candidate could be used, not overlapping each other.
+    auto get_places = [&](const SuffixArray::repeat_t &r) {
+        std::vector<size_t> places;
+        if (r.count == 0)
+        {
+            for (const std::pair<size_t, size_t> &run : runs[text[r.start] == 15])
+            {
+                for (size_t i = 0; i + r.length <= run.second; i += r.length)
+                    places.push_back(run.first + i);
+            }
         }
         else
         {
-            datafile.SetDictionaryEntry(i, dummy);
+            for (size_t p : suffixarray.GetPositions(r))
+            {
+                if (places.empty() || p >= places.back() + r.length)
+                    places.push_back(p);
+            }
+        }
+        return places;
+    };
 
-            if (verbose && d.replacement.size() != 0)
-                std::cout << "update_scores: dropped " << i
-                        << " score " << -d.score << std::endl;
+    auto get_pixels = [&](const SuffixArray::repeat_t &r) {
+        return DataFile::pixels_t(text.begin() + r.start,
+                                  text.begin() + r.start + r.length);
+    };
+
+    // Each use replaces the references for the pixels with a single one.
+    auto estimate_savings = [&](const SuffixArray::repeat_t &r,
+                                const std::vector<size_t> &places) {
+        double savings = 0;
+        for (size_t p : places)
+            savings += std::max(0.0, costs[p + r.length] - costs[p] - 1);
+
+        return (int)savings - (int)encode_rle(get_pixels(r)).size() - 2;
+    };
+
+    for (int i = 0; i < 2; i++)
+    {
+        for (const std::pair<const size_t, size_t> &run : run_starts[i])
+        {
+            if (run.first < 2)
+                continue;
+
+            SuffixArray::repeat_t r = {run.second, run.first, 0, 0};
+            int savings = estimate_savings(r, get_places(r));
+            if (savings > 0)
+            {
+                candidates.push(candidate_t(savings, repeats.size()));
+                repeats.push_back(r);
+            }
         }
     }
+
+    // The first estimate of a repeat assumes that all the occurrences cost
+    // as much as the first one, that they don't overlap, and that the entry
+    // takes 3 bytes. Repeats that are a single run are already covered by
+    // the run candidates.
+    suffixarray.ForEachRepeat([&](const SuffixArray::repeat_t &r) {
+        size_t end = r.start + r.length;
+        if (r.length < 2 || run_ends[r.start] >= end)
+            return;
+
+        double per_use = costs[end] - costs[r.start] - 1;
+        int savings = (int)(r.count * per_use) - 3;
+        if (savings > 0)
+        {
+            candidates.push(candidate_t(savings, repeats.size()));
+            repeats.push_back(r);
+        }
+    });
+
+    // Each time an entry is picked, the estimates get out of date, and they
+    // are redone when the candidate comes up. The savings only get smaller
+    // as entries are added, so a candidate whose estimate is up to date and
+    // still the best is the one to try.
+    std::vector<size_t> estimated(repeats.size(), 0);
+    size_t generation = 1;
+
+    // The best candidate is encoded for real, and taken if it makes the
+    // font smaller. The total number of evaluations is limited to keep
+    // large fonts fast.
+    size_t size = evaluator.GetEncodedSize();
+    size_t evaluations = 2 * DataFile::dictionarysize;
+    size_t index = 0;
+    while (index < DataFile::dictionarysize && !candidates.empty() && evaluations > 0)
+    {
+        candidate_t c = candidates.top();
+        candidates.pop();
+
+        const SuffixArray::repeat_t &r = repeats.at(c.second);
+        if (estimated.at(c.second) != generation)
+        {
+            c.first = estimate_savings(r, get_places(r));
+            estimated.at(c.second) = generation;
+            if (c.first > 0)
+                candidates.push(c);
+            continue;
+        }
+
+        DataFile::dictentry_t d;
+        d.replacement = get_pixels(r);
+        size_t newsize = evaluate_entry(datafile, evaluator, index, d);
+        evaluations--;
+        if (newsize >= size)
+            continue;
+
+        d.score = size - newsize;
+        datafile.SetDictionaryEntry(index, d);
+        evaluator.Update(datafile, index);
+        size = newsize;
+        index++;
+        generation++;
+
+        // Take the new entry into the costs where it is worth using.
+        std::set<size_t> glyphs;
+        for (size_t p : get_places(r))
+        {
+            if (costs[p + r.length] - costs[p] > 1)
+            {
+                std::fill(shares.begin() + p, shares.begin() + p + r.length, 1.0 / r.length);
+                glyphs.insert(get_glyph(p));
+            }
+        }
+
+        for (size_t g : glyphs)
+            sum_costs(g);
+    }
 }
 
-void init_dictionary(DataFile &datafile)
+// Counts of the pairs of adjacent symbols for Re-Pair. The pairs are found
+// through a hash table, and the pairs with each count are kept in a doubly
+// linked list, so that the most common pair is found in constant time as
+// the counts change. Each pair also has a list of the places where its
+// first symbol is. The lists are not cleaned up when a place gets replaced,
+// so the caller checks each place before use.
+class PairTable
 {
-    rnd_t rnd(datafile.GetSeed());
+public:
+    typedef std::pair<int, int> pair_t;
 
-    if (datafile.GetGlyphCount() == 0)
+    // Add delta to the count of the pair, and record a new place of it.
+    void Add(pair_t pair, int delta);
+    void AddPlace(pair_t pair, size_t place);
+
+    // Find the most common pair. Returns false if no pair has at least
+    // min_count places.
+    bool GetMostCommon(size_t min_count, pair_t &pair);
+
+    // Take the places of the pair, and set its count to zero. The count
+    // can go below zero after this, for the overlapping places of a run of
+    // the same symbol, but such a pair is never the most common again.
+    std::vector<size_t> TakePlaces(pair_t pair);
+
+private:
+    static const size_t none = std::numeric_limits<size_t>::max();
+
+    struct record_t
+    {
+        pair_t pair;
+        int count;
+        std::vector<size_t> places;
+        size_t prev, next; // Other pairs with the same count.
+    };
+
+    std::unordered_map<uint64_t, size_t> m_index;
+    std::vector<record_t> m_records;
+    std::vector<size_t> m_heads; // First pair with each count, or none.
+    size_t m_top = 0; // No count above this has pairs.
+
+    static uint64_t GetKey(pair_t pair)
+        { return ((uint64_t)(uint32_t)pair.first << 32) | (uint32_t)pair.second; }
+
+    size_t GetRecord(pair_t pair);
+    void Link(size_t r);
+    void Unlink(size_t r);
+};
+
+const size_t PairTable::none;
+
+size_t PairTable::GetRecord(pair_t pair)
+{
+    auto found = m_index.insert(std::make_pair(GetKey(pair), m_records.size()));
+    if (found.second)
+    {
+        record_t record;
+        record.pair = pair;
+        record.count = 0;
+        record.prev = record.next = none;
+        m_records.push_back(record);
+    }
+    return found.first->second;
+}
+
+void PairTable::Link(size_t r)
+{
+    record_t &record = m_records[r];
+    if (record.count <= 0)
+        return;
+
+    size_t count = record.count;
+    if (count >= m_heads.size())
+        m_heads.resize(count + 1, none);
+
+    record.prev = none;
+    record.next = m_heads[count];
+    if (record.next != none)
+        m_records[record.next].prev = r;
+    m_heads[count] = r;
+    m_top = std::max(m_top, count);
+}
+
+void PairTable::Unlink(size_t r)
+{
+    record_t &record = m_records[r];
+    if (record.count <= 0)
         return;
 
-    std::set<DataFile::pixels_t> seen_substrings;
-    std::set<DataFile::pixels_t> added_substrings;
+    if (record.prev != none)
+        m_records[record.prev].next = record.next;
+    else
+        m_heads[record.count] = record.next;
 
-    size_t i = 0;
-    while (i < DataFile::dictionarysize)
+    if (record.next != none)
+        m_records[record.next].prev = record.prev;
+}
+
+void PairTable::Add(pair_t pair, int delta)
+{
+    size_t r = GetRecord(pair);
+    Unlink(r);
+    m_records[r].count += delta;
+    Link(r);
+}
+
+void PairTable::AddPlace(pair_t pair, size_t place)
+{
+    m_records[GetRecord(pair)].places.push_back(place);
+}
+
+bool PairTable::GetMostCommon(size_t min_count, pair_t &pair)
+{
+    while (m_top >= min_count && m_heads.at(m_top) == none)
+        m_top--;
+
+    if (m_top < min_count)
+        return false;
+
+    pair = m_records[m_heads[m_top]].pair;
+    return true;
+}
+
+std::vector<size_t> PairTable::TakePlaces(pair_t pair)
+{
+    size_t r = GetRecord(pair);
+    Unlink(r);
+    m_records[r].count = 0;
+
+    std::vector<size_t> places;
+    places.swap(m_records[r].places);
+    return places;
+}
+
+// Resample a string of pixels to another glyph size, taking the nearest
+// pixel. The string is taken to start at the left edge of a row, so that
+// each pixel has a row and a column. The columns are scaled by the ratio of
+// the widths and the rows by the ratio of the heights, and the string is
+// split into rows of the new width again.
+static DataFile::pixels_t rescale_pixels(const DataFile::pixels_t &pixels,
+                                         const DataFile::fontinfo_t &from,
+                                         const DataFile::fontinfo_t &to)
+{
+    if (pixels.empty() || from.max_width <= 0 || from.max_height <= 0 ||
+        to.max_width <= 0 || to.max_height <= 0 ||
+        (from.max_width == to.max_width && from.max_height == to.max_height))
+    {
+        return pixels;
+    }
+
+    size_t from_width = from.max_width, from_height = from.max_height;
+    size_t to_width = to.max_width, to_height = to.max_height;
+
+    // The last pixel decides where the new string ends.
+    size_t last_row = (pixels.size() - 1) / from_width;
+    size_t last_col = (pixels.size() - 1) % from_width;
+    size_t length = (last_row * to_height / from_height) * to_width +
+                    last_col * to_width / from_width + 1;
+
+    DataFile::pixels_t result(length);
+    for (size_t i = 0; i < length; i++)
+    {
+        size_t row = (i / to_width) * from_height / to_height;
+        size_t col = (i % to_width) * from_width / to_width;
+        result[i] = pixels[std::min(row * from_width + col, pixels.size() - 1)];
+    }
+    return result;
+}
+
+// Decode the next character of UTF-8 text. Bytes that are not valid UTF-8
+// are taken as Latin-1 characters.
+static int next_char(const std::string &text, size_t &pos)
+{
+    uint8_t c = text[pos++];
+    int extra = (c >= 0xF0 && c < 0xF8) ? 3 : (c >= 0xE0) ? 2 : (c >= 0xC0) ? 1 : 0;
+    if (c >= 0xF8 || pos + extra > text.size())
+        return c;
+
+    int result = c & (0x3F >> extra);
+    for (int i = 0; i < extra; i++)
+    {
+        uint8_t b = text[pos + i];
+        if ((b & 0xC0) != 0x80)
+            return c;
+        result = (result << 6) | (b & 0x3F);
+    }
+
+    pos += extra;
+    return result;
+}
+
+std::vector<double> get_glyph_weights(const DataFile &datafile,
+                                      const std::string &text)
+{
+    std::map<int, size_t> glyph_of_char;
+    for (size_t i = 0; i < datafile.GetGlyphCount(); i++)
     {
-        DataFile::pixels_t substring = *random_substring(datafile, rnd);
+        for (int c : datafile.GetGlyphEntry(i).chars)
+            glyph_of_char[c] = i;
+    }
 
-        if (!seen_substrings.count(substring))
+    std::vector<double> counts(datafile.GetGlyphCount(), 0);
+    double total = 0;
+    for (size_t pos = 0; pos < text.size(); )
+    {
+        auto glyph = glyph_of_char.find(next_char(text, pos));
+        if (glyph != glyph_of_char.end())
         {
-            seen_substrings.insert(substring);
+            counts.at(glyph->second)++;
+            total++;
         }
-        else if (!added_substrings.count(substring))
+    }
+
+    if (total == 0)
+        return std::vector<double>();
+
+    for (double &w : counts)
+        w *= counts.size() / total;
+
+    return counts;
+}
+
+size_t seed_dictionary(DataFile &datafile, const DataFile &other,
+                       const optimize_options_t &options)
+{
+    size_t num_threads = options.threads;
+    if (num_threads == 0)
+        num_threads = ThreadPool::GetDefaultThreadCount();
+    ThreadPool pool(num_threads);
+
+    // Up to date scores, so that the lowest scoring slot is the one that
+    // costs the least to give up.
+    IncrementalEvaluator evaluator(datafile, options.fast, options.objective);
+    update_scores(datafile, evaluator, false, pool);
+    size_t size = evaluator.GetEncodedSize();
+
+    std::vector<DataFile::dictentry_t> candidates;
+    for (const DataFile::dictentry_t &d : other.GetDictionary())
+    {
+        if (d.replacement.size() != 0)
+            candidates.push_back(d);
+    }
+
+    std::stable_sort(candidates.begin(), candidates.end(),
+        [](const DataFile::dictentry_t &a, const DataFile::dictentry_t &b) {
+            return a.score > b.score;
+        });
+
+    std::set<DataFile::pixels_t> existing;
+    for (const DataFile::dictentry_t &d : datafile.GetDictionary())
+        existing.insert(d.replacement);
+
+    // Each entry is tried in the place of the lowest scoring one, and kept
+    // if the font gets smaller.
+    size_t taken = 0;
+    for (DataFile::dictentry_t d : candidates)
+    {
+        d.replacement = rescale_pixels(d.replacement, other.GetFontInfo(),
+                                       datafile.GetFontInfo());
+        if (d.replacement.size() < 2 || existing.count(d.replacement))
+            continue;
+
+        size_t index = datafile.GetLowScoreIndex();
+        size_t newsize = evaluate_entry(datafile, evaluator, index, d);
+        if (newsize >= size)
+            continue;
+
+        existing.erase(datafile.GetDictionaryEntry(index).replacement);
+        existing.insert(d.replacement);
+        d.score = size - newsize;
+        datafile.SetDictionaryEntry(index, d);
+        evaluator.Update(datafile, index);
+        size = newsize;
+        taken++;
+    }
+
+    update_scores(datafile, evaluator, false, pool);
+    return taken;
+}
+
+// Build the dictionary by Re-Pair: start from the glyphs encoded with an
+// empty dictionary, and repeatedly replace the most common pair of adjacent
+// symbols with a new symbol. Each new symbol becomes a candidate entry, and
+// the candidates are then added in the order they were made, as long as they
+// reduce the real encoded size.
+static void optimize_repair(DataFile &datafile, const optimize_options_t &options)
+{
+    for (size_t i = 0; i < DataFile::dictionarysize; i++)
+        datafile.SetDictionaryEntry(i, DataFile::dictentry_t());
+
+    IncrementalEvaluator evaluator(datafile, options.fast, options.objective);
+
+    // The symbols of all glyphs are kept in a single doubly linked list, with
+    // a separator between glyphs. The zeros at the end of each glyph are left
+    // out, as they are covered by REF_FILLZEROS.
+    const int separator = -1, removed = -2;
+    std::vector<DataFile::pixels_t> symbols;
+    std::map<DataFile::pixels_t, int> symbol_ids;
+    std::vector<int> text;
+    for (size_t i = 0; i < datafile.GetGlyphCount(); i++)
+    {
+        const DataFile::pixels_t &pixels = datafile.GetGlyphEntry(i).data;
+        size_t end = pixels.size();
+        while (end > 0 && pixels.at(end - 1) == 0) end--;
+
+        size_t pos = 0;
+        for (size_t length : evaluator.GetGlyphParts(datafile, i))
         {
-            // When we see a substring second time, add it.
-            DataFile::dictentry_t d;
-            d.score = 0;
-            d.replacement = substring;
-            datafile.SetDictionaryEntry(i, d);
-            i++;
-            added_substrings.insert(substring);
+            if (pos >= end)
+                break;
+
+            DataFile::pixels_t part(pixels.begin() + pos, pixels.begin() + pos + length);
+            auto found = symbol_ids.insert(std::make_pair(part, (int)symbols.size()));
+            if (found.second)
+                symbols.push_back(part);
+
+            text.push_back(found.first->second);
+            pos += length;
         }
+
+        text.push_back(separator);
+    }
+
+    size_t n = text.size();
+    std::vector<size_t> prev(n), next(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        prev[i] = i - 1;
+        next[i] = i + 1;
+    }
+
+    // Pairs are counted without overlaps.
+    typedef PairTable::pair_t pair_t;
+    PairTable pairs;
+    size_t last_place = n;
+    auto is_pair = [&](size_t i) {
+        return i < n && text[i] >= 0 && next[i] < n && text[next[i]] >= 0;
+    };
+    auto get_pair = [&](size_t i) {
+        return pair_t(text[i], text[next[i]]);
+    };
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!is_pair(i))
+            continue;
+
+        pair_t p = get_pair(i);
+        if (i > 0 && last_place == i - 1 && get_pair(i - 1) == p)
+            continue;
+
+        pairs.Add(p, 1);
+        pairs.AddPlace(p, i);
+        last_place = i;
+    }
+
+    // A new entry takes two references and a two byte offset, so a pair
+    // has to occur at least 5 times to be worth it.
+    const size_t min_count = 5;
+    std::vector<DataFile::pixels_t> candidates;
+    pair_t p;
+    while (candidates.size() < 2 * DataFile::dictionarysize &&
+           pairs.GetMostCommon(min_count, p))
+    {
+        int symbol = symbols.size();
+        DataFile::pixels_t pixels = symbols.at(p.first);
+        pixels.insert(pixels.end(), symbols.at(p.second).begin(), symbols.at(p.second).end());
+        symbols.push_back(pixels);
+        candidates.push_back(pixels);
+
+        auto change_count = [&](size_t i, int delta) {
+            pair_t q = get_pair(i);
+            pairs.Add(q, delta);
+            if (delta > 0)
+                pairs.AddPlace(q, i);
+        };
+
+        for (size_t i : pairs.TakePlaces(p))
+        {
+            if (!is_pair(i) || get_pair(i) != p)
+                continue;
+
+            size_t j = next[i];
+            if (is_pair(prev[i]))
+                change_count(prev[i], -1);
+            if (is_pair(j))
+                change_count(j, -1);
+
+            text[i] = symbol;
+            text[j] = removed;
+            next[i] = next[j];
+            if (next[j] < n)
+                prev[next[j]] = i;
+
+            if (is_pair(prev[i]))
+                change_count(prev[i], 1);
+            if (is_pair(i))
+                change_count(i, 1);
+        }
+    }
+
+    // The fill entries that the new entries push out are not taken into
+    // account above, so each candidate is checked with the real encoder.
+    size_t size = evaluator.GetEncodedSize();
+    size_t index = 0;
+    for (size_t i = 0; i < candidates.size() && index < DataFile::dictionarysize; i++)
+    {
+        DataFile::dictentry_t d;
+        d.replacement = candidates[i];
+        d.ref_encode = true;
+        size_t newsize = evaluate_entry(datafile, evaluator, index, d);
+        if (newsize >= size)
+            continue;
+
+        d.score = size - newsize;
+        datafile.SetDictionaryEntry(index, d);
+        evaluator.Update(datafile, index);
+        size = newsize;
+        index++;
     }
 }
 
-void optimize(DataFile &datafile, size_t iterations)
+// Check whether the time given for the optimizer has run out.
+static bool past_deadline(const optimize_options_t &options)
 {
-    bool verbose = false;
-    rnd_t rnd(datafile.GetSeed());
+    return std::chrono::steady_clock::now() >= options.deadline;
+}
+
+// Run the rounds of optimize() on a single dictionary. Each round runs
+// several passes in parallel and keeps the best one.
+static void optimize_tasks(DataFile &datafile, const optimize_options_t &options,
+    optimize_state_t &state, rnd_t &rnd, bool verbose, size_t num_threads)
+{
+    size_t num_tasks = std::max<size_t>(options.tasks, 1);
+
+    // The batch mode splits its candidates between all the threads.
+    ThreadPool pool(std::min(num_threads, options.batch > 0 ? options.batch : num_tasks));
+
+    IncrementalEvaluator evaluator(datafile, options.fast, options.objective);
+    update_scores(datafile, evaluator, verbose, pool);
+
+    if (options.sample > 1)
+        evaluator.SetSample(options.sample, rnd());
+
+    size_t size = evaluator.GetEncodedSize();
+
+    // With annealing the size can also go up, so the best dictionary seen
+    // during the call is kept and returned at the end.
+    bool annealing = (options.temperature > 0);
+    std::unique_ptr<DataFile> best;
+    if (annealing)
+        best.reset(new DataFile(datafile));
+    size_t best_size = size;
+
+    // In the batch mode, each round is a single steepest descent step.
+    if (options.batch > 0)
+    {
+        std::vector<DataFile> datafiles;
+        std::vector<IncrementalEvaluator> evaluators;
+        for (size_t t = 1; t < pool.GetThreadCount(); t++)
+        {
+            datafiles.emplace_back(datafile);
+            evaluators.emplace_back(evaluator);
+        }
 
-    update_scores(datafile, verbose);
+        for (size_t i = 0; i < options.iterations && !past_deadline(options); i++)
+        {
+            optimize_batch(datafile, evaluator, size, rnd, verbose, pool,
+                           options.batch, datafiles, evaluators);
+            state.rounds++;
+        }
 
-    size_t size = get_encoded_size(datafile);
+        return;
+    }
 
-    for (size_t i = 0; i < iterations; i++)
+    for (size_t i = 0; i < options.iterations && !past_deadline(options); i++)
     {
-        optimize_parallel(datafile, size, rnd, verbose);
+        std::vector<double> weights;
+        if (options.adaptive)
+            weights = get_operator_weights(state);
+
+        double temperature = 0;
+        if (annealing)
+            temperature = options.temperature * std::pow(options.cooling, state.rounds);
+
+        pass_stats_t round;
+        optimize_parallel(datafile, evaluator, size, rnd, temperature, verbose,
+                          pool, num_tasks, weights, round);
+
+        if (options.adaptive)
+            update_operator_stats(state, round);
+
+        state.rounds++;
+
+        if (annealing && size < best_size)
+        {
+            *best = datafile;
+            best_size = size;
+        }
     }
 
+    if (annealing && best_size < size)
+        datafile = *best;
+}
+
+// Offer the best entries of one island to another. Each of them is tried
+// in place of the lowest scoring entry, and kept if it makes the font
+// smaller there.
+static void migrate_entries(const std::vector<DataFile::dictentry_t> &from,
+    DataFile &datafile, IncrementalEvaluator &evaluator, size_t &size,
+    size_t count, bool verbose)
+{
+    std::vector<DataFile::dictentry_t> entries = from;
+    std::stable_sort(entries.begin(), entries.end(),
+        [](const DataFile::dictentry_t &a, const DataFile::dictentry_t &b) {
+            return a.score > b.score;
+        });
+
+    std::set<DataFile::pixels_t> present;
+    for (const DataFile::dictentry_t &d : datafile.GetDictionary())
+        present.insert(d.replacement);
+
+    for (size_t i = 0; i < entries.size() && i < count; i++)
+    {
+        DataFile::dictentry_t d = entries[i];
+        if (d.replacement.empty() || present.count(d.replacement))
+            continue;
+
+        size_t worst = datafile.GetLowScoreIndex();
+        size_t newsize = evaluate_entry(datafile, evaluator, worst, d);
+        if (newsize < size)
+        {
+            d.score = size - newsize;
+            datafile.SetDictionaryEntry(worst, d);
+            evaluator.Update(datafile, worst);
+            size = newsize;
+            present.insert(d.replacement);
+
+            if (verbose)
+                std::cout << "migrate_entries: replaced " << worst
+                          << " score " << d.score << std::endl;
+        }
+    }
+}
+
+// Combine two dictionaries: the better half of the entries of the first,
+// by score, and as many of the best entries of the second as still fit.
+static DataFile crossover(const DataFile &first, const DataFile &second)
+{
+    auto by_score = [](const DataFile &datafile) {
+        std::vector<DataFile::dictentry_t> entries = datafile.GetDictionary();
+        std::stable_sort(entries.begin(), entries.end(),
+            [](const DataFile::dictentry_t &a, const DataFile::dictentry_t &b) {
+                return a.score > b.score;
+            });
+        return entries;
+    };
+
+    std::vector<DataFile::dictentry_t> entries;
+    std::set<DataFile::pixels_t> present;
+    for (const DataFile::dictentry_t &d : by_score(first))
+    {
+        if (entries.size() == DataFile::dictionarysize / 2)
+            break;
+
+        if (!d.replacement.empty() && present.insert(d.replacement).second)
+            entries.push_back(d);
+    }
+
+    for (const DataFile::dictentry_t &d : by_score(second))
+    {
+        if (entries.size() == DataFile::dictionarysize)
+            break;
+
+        if (!d.replacement.empty() && present.insert(d.replacement).second)
+            entries.push_back(d);
+    }
+
+    DataFile child(first);
+    for (size_t i = 0; i < DataFile::dictionarysize; i++)
+    {
+        if (i < entries.size())
+            child.SetDictionaryEntry(i, entries[i]);
+        else
+            child.SetDictionaryEntry(i, DataFile::dictentry_t());
+    }
+
+    return child;
+}
+
+// Run the rounds of optimize() on a population of islands, each with its
+// own dictionary. The islands evolve separately, and every few rounds each
+// of them is offered the best entries of the previous one in a ring. At
+// the same time the two best islands are crossed over, and the child takes
+// the place of the worst island if it is smaller. The islands are kept in
+// the state between calls, and the best of them is returned.
+static void optimize_islands(DataFile &datafile, const optimize_options_t &options,
+    optimize_state_t &state, rnd_t &rnd, bool verbose, size_t num_threads)
+{
+    size_t count = options.islands;
+    ThreadPool pool(std::min(num_threads, count));
+
+    // The result is never worse than the dictionary passed in.
+    IncrementalEvaluator evaluator(datafile, options.fast, options.objective);
+    size_t best_size = evaluator.GetEncodedSize();
+
+    if (state.islands.size() != count)
+    {
+        DataFile start(datafile);
+        update_scores(start, evaluator, verbose, pool);
+        state.islands.assign(count, start);
+    }
+
+    std::vector<DataFile> &islands = state.islands;
+    std::vector<std::unique_ptr<IncrementalEvaluator> > evaluators(count);
+    std::vector<size_t> sizes(count);
+    uint32_t sample_seed = (options.sample > 1) ? rnd() : 0;
+    pool.Run(count, [&](size_t k) {
+        evaluators.at(k).reset(new IncrementalEvaluator(islands.at(k), options.fast,
+                                                         options.objective));
+        evaluators.at(k)->SetSample(options.sample, sample_seed);
+        sizes.at(k) = evaluators.at(k)->GetEncodedSize();
+    });
+    bool annealing = (options.temperature > 0);
+
+    for (size_t i = 0; i < options.iterations && !past_deadline(options); i++)
+    {
+        std::vector<double> weights;
+        if (options.adaptive)
+            weights = get_operator_weights(state);
+
+        double temperature = 0;
+        if (annealing)
+            temperature = options.temperature * std::pow(options.cooling, state.rounds);
+
+        std::vector<rnd_t> rnds;
+        for (size_t k = 0; k < count; k++)
+            rnds.emplace_back(rnd());
+
+        std::vector<pass_stats_t> island_stats(count);
+        pool.Run(count, [&](size_t k) {
+            optimize_pass(islands.at(k), *evaluators.at(k), sizes.at(k), rnds.at(k),
+                          temperature, verbose, weights, island_stats.at(k));
+        });
+
+        pass_stats_t round;
+        for (const pass_stats_t &t : island_stats)
+        {
+            for (size_t op = 0; op < operator_count; op++)
+            {
+                round.saved.at(op) += t.saved.at(op);
+                round.tries.at(op) += t.tries.at(op);
+            }
+        }
+
+        if (options.adaptive)
+            update_operator_stats(state, round);
+
+        state.rounds++;
+
+        if (options.migration != 0 && state.rounds % options.migration == 0)
+        {
+            std::vector<std::vector<DataFile::dictentry_t> > dictionaries;
+            for (const DataFile &island : islands)
+                dictionaries.push_back(island.GetDictionary());
+
+            pool.Run(count, [&](size_t k) {
+                migrate_entries(dictionaries.at((k + count - 1) % count),
+                                islands.at(k), *evaluators.at(k), sizes.at(k),
+                                options.migrants, verbose);
+            });
+
+            std::vector<size_t> order(count);
+            std::iota(order.begin(), order.end(), 0);
+            std::stable_sort(order.begin(), order.end(),
+                [&](size_t a, size_t b) { return sizes.at(a) < sizes.at(b); });
+
+            DataFile child = crossover(islands.at(order[0]), islands.at(order[1]));
+            std::unique_ptr<IncrementalEvaluator> child_evaluator(
+                new IncrementalEvaluator(child, options.fast, options.objective));
+            size_t child_size = child_evaluator->GetEncodedSize();
+            size_t worst = order.back();
+            if (child_size < sizes.at(worst))
+            {
+                if (verbose)
+                    std::cout << "optimize_islands: crossover of " << order[0]
+                              << " and " << order[1] << " replaced " << worst
+                              << ", size " << child_size << std::endl;
+
+                islands.at(worst) = child;
+                evaluators.at(worst) = std::move(child_evaluator);
+                sizes.at(worst) = child_size;
+            }
+        }
+    }
+
+    size_t best = std::min_element(sizes.begin(), sizes.end()) - sizes.begin();
+    if (sizes.at(best) < best_size)
+        datafile = islands.at(best);
+}
+
+void optimize(DataFile &datafile, const optimize_options_t &options,
+              optimize_state_t *state)
+{
+    if (options.method == METHOD_REPAIR)
+    {
+        optimize_repair(datafile, options);
+        return;
+    }
+
+    bool verbose = false;
+    rnd_t rnd(datafile.GetSeed());
+
+    size_t num_threads = options.threads;
+    if (num_threads == 0)
+        num_threads = ThreadPool::GetDefaultThreadCount();
+
+    optimize_state_t local_state;
+    if (!state)
+        state = &local_state;
+
+    if (options.islands > 1)
+        optimize_islands(datafile, options, *state, rnd, verbose, num_threads);
+    else
+        optimize_tasks(datafile, options, *state, rnd, verbose, num_threads);
+
     std::uniform_int_distribution<size_t> dist(0, std::numeric_limits<uint32_t>::max());
     datafile.SetSeed(dist(rnd));
 }
 
+#define STATE_FORMAT_VERSION 1
+
+void save_state(std::ostream &file, const optimize_state_t &state,
+                const DataFile &datafile)
+{
+    file << "StateVersion " << STATE_FORMAT_VERSION << std::endl;
+    file << "RandomSeed " << datafile.GetSeed() << std::endl;
+    file << "Iterations " << state.iterations << std::endl;
+    file << "BestSize " << state.best_size << std::endl;
+    file << "Stalled " << state.stalled << std::endl;
+    file << "Rounds " << state.rounds << std::endl;
+
+    // The data file leaves out the empty dictionary entries, which moves
+    // the ones after them. Their places are needed to continue the same.
+    file << "EmptyEntries";
+    for (size_t i = 0; i < DataFile::dictionarysize; i++)
+    {
+        if (datafile.GetDictionaryEntry(i).replacement.size() == 0)
+            file << " " << i;
+    }
+    file << std::endl;
+
+    // The savings are written with full precision, so that the adaptive
+    // mode continues exactly as it would have without the restart.
+    file << "Savings";
+    file << std::setprecision(std::numeric_limits<double>::max_digits10);
+    for (double s : state.savings)
+        file << " " << s;
+    file << std::endl;
+
+    for (const DataFile &island : state.islands)
+    {
+        file << "Island" << std::endl;
+        for (size_t i = 0; i < DataFile::dictionarysize; i++)
+        {
+            const DataFile::dictentry_t &d = island.GetDictionaryEntry(i);
+            if (d.replacement.size() != 0)
+            {
+                file << "IslandEntry " << i << " " << d.score << " ";
+                file << d.ref_encode << " " << d.replacement << std::endl;
+            }
+        }
+    }
+}
+
+bool load_state(std::istream &file, optimize_state_t &state,
+                DataFile &datafile)
+{
+    optimize_state_t result;
+    std::set<size_t> empty;
+    int version = -1;
+    uint32_t seed = 0;
+    bool has_seed = false;
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream input(line);
+        std::string tag;
+
+        input >> tag;
+
+        if (tag == "StateVersion")
+        {
+            input >> version;
+        }
+        else if (tag == "RandomSeed")
+        {
+            has_seed = static_cast<bool>(input >> seed);
+        }
+        else if (tag == "Iterations")
+        {
+            input >> result.iterations;
+        }
+        else if (tag == "BestSize")
+        {
+            input >> result.best_size;
+        }
+        else if (tag == "Stalled")
+        {
+            input >> result.stalled;
+        }
+        else if (tag == "Rounds")
+        {
+            input >> result.rounds;
+        }
+        else if (tag == "EmptyEntries")
+        {
+            size_t index;
+            while (input >> index)
+                empty.insert(index);
+        }
+        else if (tag == "Savings")
+        {
+            double s;
+            while (input >> s)
+                result.savings.push_back(s);
+        }
+        else if (tag == "Island")
+        {
+            DataFile island = datafile;
+            for (size_t i = 0; i < DataFile::dictionarysize; i++)
+                island.SetDictionaryEntry(i, DataFile::dictentry_t());
+            result.islands.push_back(island);
+        }
+        else if (tag == "IslandEntry" && !result.islands.empty())
+        {
+            size_t index;
+            DataFile::dictentry_t d = {};
+            if (!(input >> index >> d.score >> d.ref_encode) ||
+                index >= DataFile::dictionarysize)
+            {
+                return false;
+            }
+
+            input >> d.replacement;
+            result.islands.back().SetDictionaryEntry(index, d);
+        }
+    }
+
+    if (version != STATE_FORMAT_VERSION || !has_seed || seed != datafile.GetSeed())
+        return false;
+
+    std::vector<DataFile::dictentry_t> entries;
+    for (const DataFile::dictentry_t &d : datafile.GetDictionary())
+    {
+        if (d.replacement.size() != 0)
+            entries.push_back(d);
+    }
+
+    if (entries.size() + empty.size() != DataFile::dictionarysize)
+        return false;
+
+    size_t next = 0;
+    for (size_t i = 0; i < DataFile::dictionarysize; i++)
+    {
+        if (empty.count(i))
+            datafile.SetDictionaryEntry(i, DataFile::dictentry_t());
+        else
+            datafile.SetDictionaryEntry(i, entries.at(next++));
+    }
+
+    state = result;
+    return true;
+}
+
 }}
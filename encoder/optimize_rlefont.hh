@@ -1,6 +1,11 @@
 // This implements the actual optimization passes of the compressor.
 
+#pragma once
 #include "datafile.hh"
+#include <chrono>
+#include "encode_rlefont.hh"
+#include <iostream>
+#include <random>
 
 namespace mcufont {
 namespace rlefont {
@@ -8,8 +13,533 @@ namespace rlefont {
 // Initialize the dictionary table with reasonable guesses.
 void init_dictionary(DataFile &datafile);
 
+// Algorithms for optimize().
+enum method_t
+{
+    METHOD_RANDOM, // Random changes to the entries, keeping the ones that help.
+    METHOD_REPAIR  // Build the dictionary from the most common pairs of codes.
+};
+
+// Settings for the optimizer.
+struct optimize_options_t
+{
+    // Number of rounds to run in one optimize() call.
+    size_t iterations = 50;
+
+    // Stop the call at this time instead, checked before each round. The
+    // default never stops early.
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::time_point::max();
+
+    // Number of worker threads, 0 to use all hardware threads.
+    size_t threads = 0;
+
+    // Number of independent passes per round, of which the best is kept.
+    // The result depends only on this and the seed, not on the thread
+    // count, so the default is the same on every machine.
+    size_t tasks = 4;
+
+    // Score candidates with the greedy encoder instead of the optimal one
+    // that is used for export.
+    bool fast = false;
+
+    // METHOD_REPAIR replaces the whole dictionary and gives the same result
+    // each time, so one round of it is enough.
+    method_t method = METHOD_RANDOM;
+
+    // Pick the optimization algorithms by how much they have been saving
+    // lately, instead of running each of them once per pass.
+    bool adaptive = false;
+
+    // Starting temperature for simulated annealing, in bytes. Above zero,
+    // changes that make the font larger are also kept now and then. The
+    // best result seen is what optimize() leaves in the datafile.
+    double temperature = 0;
+
+    // Factor by which the temperature falls after each round.
+    double cooling = 0.999;
+
+    // Number of islands for the population mode, or 0 or 1 to optimize a
+    // single dictionary. Each island runs one pass per round.
+    size_t islands = 0;
+
+    // Rounds between migrations, and the number of entries offered to the
+    // next island each time.
+    size_t migration = 10;
+    size_t migrants = 8;
+
+    // Number of candidates per round for the batch mode, or 0 to use the
+    // random passes. In the batch mode each round evaluates this many
+    // replacements for the lowest scoring entry and applies the best one.
+    size_t batch = 0;
+
+    // Score moves first on one glyph out of every this many, picked anew
+    // on each optimize() call, and encode all the glyphs only for the
+    // moves that look like improvements. 0 or 1 scores on all glyphs.
+    size_t sample = 0;
+
+    // Weight of the decode cost against the size. With glyph weights from
+    // get_glyph_weights(), the often used glyphs get encodings that are
+    // quicker to draw at some cost in size.
+    objective_t objective;
+};
+
+// Weight the glyphs by how often their characters occur in the given UTF-8
+// text, scaled so that the weights add up to the number of glyphs. Glyphs
+// that do not occur get the weight 0. Returns an empty vector, which
+// weights all glyphs equally, if none of the characters are in the font.
+std::vector<double> get_glyph_weights(const DataFile &datafile,
+                                      const std::string &text);
+
+// Take dictionary entries from another font, such as another size of the
+// same typeface. The entries are resampled to the glyph width and height
+// of this font, and each one replaces the lowest scoring entry if that makes the
+// font smaller. Uses the threads and fast settings of the options.
+// Returns the number of entries taken.
+size_t seed_dictionary(DataFile &datafile, const DataFile &other,
+                       const optimize_options_t &options);
+
+// State of the optimizer that carries over from one optimize() call to the
+// next, when the same object is passed to each of them.
+struct optimize_state_t
+{
+    // Average bytes saved per try by each optimization algorithm, with the
+    // older rounds fading out. Used by the adaptive mode.
+    std::vector<double> savings;
+
+    // Number of rounds run so far, for the annealing schedule and the
+    // migrations.
+    size_t rounds = 0;
+
+    // Dictionaries of the islands in the population mode.
+    std::vector<DataFile> islands;
+
+    // Progress of the caller's run, not used by optimize(). Kept here so
+    // that a checkpoint holds everything needed to resume the run.
+    size_t iterations = 0;
+    size_t best_size = 0;
+    size_t stalled = 0;
+};
+
+// Write the optimizer state to a text file. The random generator is
+// re-seeded from the datafile on each optimize() call, so the state file
+// records that seed and only matches the datafile saved along with it.
+void save_state(std::ostream &file, const optimize_state_t &state,
+                const DataFile &datafile);
+
+// Read a state written by save_state(), and put the dictionary entries of
+// the datafile back in the places they had. Returns false if the file is
+// not valid or was saved with a different datafile.
+bool load_state(std::istream &file, optimize_state_t &state,
+                DataFile &datafile);
+
 // Perform a single optimization step, consisting itself of multiple passes
 // of each of the optimization algorithms.
-void optimize(DataFile &datafile, size_t iterations = 50);
+void optimize(DataFile &datafile, const optimize_options_t &options = optimize_options_t(),
+              optimize_state_t *state = nullptr);
+
+// Parts of optimize(), declared here for the tests.
+typedef std::mt19937 rnd_t;
+
+// Number of optimization algorithms that the passes pick from.
+const size_t operator_count = 8;
+
+// Run one of the optimization algorithms, by its index, on the dictionary
+// that the evaluator was made for. Changes that make the font larger are
+// kept as in simulated annealing if the temperature is above zero. Size is
+// the current value of the objective and is updated for a kept change.
+void run_operator(size_t op, DataFile &datafile, IncrementalEvaluator &evaluator,
+    size_t &size, rnd_t &rnd, double temperature, bool verbose);
+
+// Draw the candidates of one round of the batch mode: random substrings and
+// random parts of encoded glyphs, in order from rnd.
+std::vector<DataFile::dictentry_t> get_batch_candidates(const DataFile &datafile,
+    const IncrementalEvaluator &evaluator, rnd_t &rnd, size_t batch);
+
+// Try the candidates from get_batch_candidates() for the lowest scoring
+// entry, and apply the best one if it makes the font smaller. Each task
+// evaluates every num_tasks'th candidate on its own copy of the state, and
+// ties go to the earliest candidate, so the result does not depend on the
+// thread count. The copies are kept in sync by the caller passing the same
+// ones in each time.
+void optimize_batch(DataFile &datafile, IncrementalEvaluator &evaluator,
+    size_t &size, rnd_t &rnd, bool verbose, ThreadPool &pool, size_t batch,
+    std::vector<DataFile> &datafiles, std::vector<IncrementalEvaluator> &evaluators);
 
 }}
+
+#ifdef CXXTEST_RUNNING
+#include <cxxtest/TestSuite.h>
+#include <sstream>
+#include <algorithm>
+
+using namespace mcufont;
+using namespace mcufont::rlefont;
+
+class RLEFontOptimizeTests: public CxxTest::TestSuite
+{
+public:
+    void testThreadCount()
+    {
+        // With the task count fixed, the threads only change the speed.
+        std::unique_ptr<DataFile> f1 = make_font();
+        std::unique_ptr<DataFile> f2 = make_font();
+        optimize_options_t options = quick_options();
+        options.threads = 1;
+        optimize(*f1, options);
+        options.threads = 3;
+        optimize(*f2, options);
+        TS_ASSERT_EQUALS(save(*f1), save(*f2));
+    }
+
+    void testScoresThreadCount()
+    {
+        // Entries that are never used get dropped while the threads are
+        // scoring the ones after them.
+        std::unique_ptr<DataFile> f1 = make_font();
+        DataFile::dictentry_t unused;
+        unused.replacement = {1, 2, 3, 4, 5};
+        f1->SetDictionaryEntry(1, unused);
+        f1->SetDictionaryEntry(6, unused);
+        std::unique_ptr<DataFile> f2(new DataFile(*f1));
+
+        optimize_options_t options = quick_options();
+        options.iterations = 0;
+        options.threads = 1;
+        optimize(*f1, options);
+        options.threads = 4;
+        optimize(*f2, options);
+
+        TS_ASSERT_EQUALS(f1->GetDictionaryEntry(1).replacement.size(), 0);
+        TS_ASSERT_EQUALS(f1->GetDictionaryEntry(6).replacement.size(), 0);
+        for (size_t i = 0; i < DataFile::dictionarysize; i++)
+        {
+            TS_ASSERT_EQUALS(f1->GetDictionaryEntry(i).score,
+                             f2->GetDictionaryEntry(i).score);
+        }
+        TS_ASSERT_EQUALS(save(*f1), save(*f2));
+    }
+
+    void testInitDictionary()
+    {
+        // The entries that the suffix array search found for this font.
+        static const char *expected[] = {
+            "08FF80",
+            "00FF000F00F0F0000FFFFFFF000000",
+            "F0000F08FF80",
+            "00000000FF00"};
+
+        std::unique_ptr<DataFile> f = make_font();
+        for (size_t i = 0; i < 4; i++)
+        {
+            std::ostringstream s;
+            s << f->GetDictionaryEntry(i).replacement;
+            TS_ASSERT_EQUALS(s.str(), expected[i]);
+            TS_ASSERT(!f->GetDictionaryEntry(i).ref_encode);
+        }
+        TS_ASSERT_EQUALS(f->GetDictionaryEntry(4).replacement.size(), 0);
+
+        // Each entry is a substring that repeats in the glyphs.
+        for (size_t i = 0; i < 4; i++)
+        {
+            const DataFile::pixels_t &entry = f->GetDictionaryEntry(i).replacement;
+            size_t count = 0;
+            for (const DataFile::glyphentry_t &g : f->GetGlyphTable())
+            {
+                auto pos = g.data.begin();
+                while ((pos = std::search(pos, g.data.end(),
+                            entry.begin(), entry.end())) != g.data.end())
+                {
+                    count++;
+                    pos++;
+                }
+            }
+            TS_ASSERT_LESS_THAN_EQUALS(2, count);
+        }
+    }
+
+    void testAdaptive()
+    {
+        optimize_options_t options = quick_options();
+        options.adaptive = true;
+        check_size(options);
+
+        // A deadline that has passed stops the call before the first round.
+        std::unique_ptr<DataFile> f = make_font();
+        optimize_state_t state;
+        options.deadline = std::chrono::steady_clock::now();
+        optimize(*f, options, &state);
+        TS_ASSERT_EQUALS(state.rounds, 0);
+    }
+
+    void testAnnealing()
+    {
+        // The size may go up during the call, but the best one is kept.
+        optimize_options_t options = quick_options();
+        options.temperature = 20;
+        options.cooling = 0.9;
+        check_size(options);
+
+        // From a dictionary that the plain passes have optimized, a walk at
+        // a high temperature keeps changes that make the font larger, and
+        // the size stays exact.
+        std::unique_ptr<DataFile> f = make_font();
+        for (size_t i = 0; i < 3; i++)
+            optimize(*f, quick_options());
+        DataFile optimized(*f);
+
+        IncrementalEvaluator evaluator(*f, true);
+        size_t start = evaluator.GetEncodedSize();
+        size_t size = start;
+        size_t increases = 0;
+        rnd_t rnd(1);
+        for (size_t i = 0; i < 4 * operator_count; i++)
+        {
+            size_t oldsize = size;
+            run_operator(i % operator_count, *f, evaluator, size, rnd, 1e6, false);
+            TS_ASSERT_EQUALS(size, get_encoded_size(*f));
+            if (size > oldsize)
+                increases++;
+        }
+        TS_ASSERT_LESS_THAN(0, increases);
+        TS_ASSERT_LESS_THAN(start, size);
+
+        // The same kind of walk inside optimize() leaves the best dictionary
+        // seen, which is no larger than the one it started from.
+        *f = optimized;
+        options.temperature = 1e6;
+        options.cooling = 1;
+        optimize(*f, options);
+        TS_ASSERT_LESS_THAN_EQUALS(get_encoded_size(*f), start);
+    }
+
+    void testIslands()
+    {
+        optimize_options_t options = quick_options();
+        options.islands = 3;
+        options.migration = 2;
+        check_size(options);
+
+        // Start one optimized island and two with an empty dictionary, and
+        // run one round with and without a migration after it. The passes
+        // are the same in both runs, so any difference comes from the
+        // migration and the crossover, which only keep improvements.
+        std::unique_ptr<DataFile> f = make_font();
+        for (size_t i = 0; i < 3; i++)
+            optimize(*f, quick_options());
+        DataFile empty(*f);
+        for (size_t i = 0; i < DataFile::dictionarysize; i++)
+            empty.SetDictionaryEntry(i, DataFile::dictentry_t());
+
+        optimize_options_t single = options;
+        single.iterations = 1;
+        single.migration = 0;
+        optimize_state_t apart;
+        apart.islands = {*f, empty, empty};
+        DataFile result(*f);
+        optimize(result, single, &apart);
+
+        single.migration = 1;
+        optimize_state_t mixed;
+        mixed.islands = {*f, empty, empty};
+        result = *f;
+        optimize(result, single, &mixed);
+
+        size_t total_apart = 0, total_mixed = 0;
+        for (size_t k = 0; k < 3; k++)
+        {
+            size_t size_apart = get_encoded_size(apart.islands.at(k));
+            size_t size_mixed = get_encoded_size(mixed.islands.at(k));
+            TS_ASSERT_LESS_THAN_EQUALS(size_mixed, size_apart);
+            total_apart += size_apart;
+            total_mixed += size_mixed;
+        }
+        TS_ASSERT_LESS_THAN(total_mixed, total_apart);
+        TS_ASSERT_DIFFERS(save(mixed.islands.at(1)), save(apart.islands.at(1)));
+    }
+
+    void testBatch()
+    {
+        optimize_options_t options = quick_options();
+        options.batch = 16;
+        check_size(options);
+
+        // The candidates are shared out to the threads in a fixed way.
+        std::unique_ptr<DataFile> f1 = make_font();
+        std::unique_ptr<DataFile> f2 = make_font();
+        options.threads = 1;
+        optimize(*f1, options);
+        options.threads = 3;
+        optimize(*f2, options);
+        TS_ASSERT_EQUALS(save(*f1), save(*f2));
+
+        // The entry applied is the candidate that gives the smallest font,
+        // the earliest one of those if there is a tie.
+        std::unique_ptr<DataFile> f = make_font();
+        IncrementalEvaluator evaluator(*f, true);
+        size_t size = evaluator.GetEncodedSize();
+        size_t worst = f->GetLowScoreIndex();
+        rnd_t rnd1(3), rnd2(3);
+        std::vector<DataFile::dictentry_t> candidates =
+            get_batch_candidates(*f, evaluator, rnd1, 16);
+
+        size_t best = 0, best_size = size;
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            DataFile trial(*f);
+            trial.SetDictionaryEntry(worst, candidates.at(i));
+            size_t trial_size = get_encoded_size(trial);
+            if (trial_size < best_size)
+            {
+                best = i;
+                best_size = trial_size;
+            }
+        }
+        TS_ASSERT_LESS_THAN(best_size, size);
+
+        ThreadPool pool(1);
+        std::vector<DataFile> datafiles;
+        std::vector<IncrementalEvaluator> evaluators;
+        optimize_batch(*f, evaluator, size, rnd2, false, pool, 16, datafiles, evaluators);
+        TS_ASSERT_EQUALS(size, best_size);
+        TS_ASSERT_EQUALS(size, get_encoded_size(*f));
+        TS_ASSERT(f->GetDictionaryEntry(worst).replacement == candidates.at(best).replacement);
+        TS_ASSERT_EQUALS(f->GetDictionaryEntry(worst).ref_encode, candidates.at(best).ref_encode);
+    }
+
+    void testSample()
+    {
+        // Moves are confirmed on all the glyphs before they are kept, also
+        // together with annealing.
+        optimize_options_t options = quick_options();
+        options.sample = 4;
+        check_size(options);
+
+        options.temperature = 20;
+        check_size(options);
+
+        // Each move kept after scoring it on the sample reports the size
+        // of the whole font, with and without annealing.
+        for (double temperature : {0.0, 20.0})
+        {
+            std::unique_ptr<DataFile> f = make_font();
+            IncrementalEvaluator evaluator(*f, true);
+            evaluator.SetSample(4, 7);
+            TS_ASSERT(evaluator.HasSample());
+
+            size_t size = evaluator.GetEncodedSize();
+            size_t kept = 0;
+            rnd_t rnd(2);
+            for (size_t i = 0; i < 4 * operator_count; i++)
+            {
+                size_t oldsize = size;
+                run_operator(i % operator_count, *f, evaluator, size, rnd,
+                             temperature, false);
+                TS_ASSERT_EQUALS(size, get_encoded_size(*f));
+                TS_ASSERT_EQUALS(size, evaluator.GetEncodedSize());
+                if (size != oldsize)
+                    kept++;
+            }
+            TS_ASSERT_LESS_THAN(0, kept);
+        }
+    }
+
+    void testResume()
+    {
+        optimize_options_t options = quick_options();
+        options.adaptive = true;
+        options.temperature = 20;
+        check_resume(options);
+
+        options = quick_options();
+        options.islands = 3;
+        options.migration = 2;
+        check_resume(options);
+    }
+
+private:
+    // A small font whose glyphs are built from a few repeating rows.
+    static std::unique_ptr<DataFile> make_font()
+    {
+        static const uint8_t rows[6][6] = {
+            {0, 0, 15, 15, 0, 0}, {0, 15, 0, 0, 15, 0}, {15, 0, 0, 0, 0, 15},
+            {15, 15, 15, 15, 15, 15}, {0, 0, 0, 0, 0, 0}, {0, 8, 15, 15, 8, 0}};
+
+        std::vector<DataFile::glyphentry_t> glyphs(16);
+        for (size_t i = 0; i < glyphs.size(); i++)
+        {
+            DataFile::glyphentry_t &g = glyphs.at(i);
+            g.chars.push_back('A' + i);
+            g.width = 6;
+            for (size_t r = 0; r < 8; r++)
+            {
+                const uint8_t *row = rows[(i * 7 + r * (i % 3 + 1)) % 6];
+                g.data.insert(g.data.end(), row, row + 6);
+            }
+        }
+
+        DataFile::fontinfo_t fontinfo = {"Test", 6, 8, 0, 6, 8, 0};
+        std::unique_ptr<DataFile> f(new DataFile({}, glyphs, fontinfo));
+        init_dictionary(*f);
+        return f;
+    }
+
+    static optimize_options_t quick_options()
+    {
+        optimize_options_t options;
+        options.iterations = 3;
+        options.fast = true;
+        return options;
+    }
+
+    // Run a few optimize() calls, none of which may make the font larger.
+    static void check_size(const optimize_options_t &options)
+    {
+        std::unique_ptr<DataFile> f = make_font();
+        optimize_state_t state;
+        size_t size = get_encoded_size(*f);
+        for (size_t i = 0; i < 3; i++)
+        {
+            optimize(*f, options, &state);
+            size_t newsize = get_encoded_size(*f);
+            TS_ASSERT_LESS_THAN_EQUALS(newsize, size);
+            size = newsize;
+        }
+        TS_ASSERT_LESS_THAN(0, state.rounds);
+    }
+
+    // Stop after one optimize() call, save the state and the datafile as
+    // text and continue from them. The result must match an uninterrupted
+    // run of two calls.
+    static void check_resume(const optimize_options_t &options)
+    {
+        std::unique_ptr<DataFile> f1 = make_font();
+        optimize_state_t state1;
+        optimize(*f1, options, &state1);
+        optimize(*f1, options, &state1);
+
+        std::unique_ptr<DataFile> f2 = make_font();
+        optimize_state_t state2;
+        optimize(*f2, options, &state2);
+
+        std::stringstream statefile, datafile;
+        save_state(statefile, state2, *f2);
+        f2->Save(datafile);
+
+        std::unique_ptr<DataFile> f3 = DataFile::Load(datafile);
+        optimize_state_t state3;
+        TS_ASSERT(load_state(statefile, state3, *f3));
+        optimize(*f3, options, &state3);
+
+        TS_ASSERT_EQUALS(save(*f1), save(*f3));
+        TS_ASSERT_EQUALS(state1.rounds, state3.rounds);
+    }
+
+    static std::string save(const DataFile &datafile)
+    {
+        std::ostringstream s;
+        datafile.Save(s);
+        return s.str();
+    }
+};
+#endif
@@ -0,0 +1,153 @@
+#include "threadpool.hh"
+#include "ccfixes.hh"
+
+namespace mcufont {
+
+// The pools whose tasks the current thread is executing, innermost first,
+// so that a nested Run() on one of them doesn't wait for workers that are
+// busy running its parent. Another pool can still use its own workers.
+struct running_task_t
+{
+    const ThreadPool *pool;
+    const running_task_t *outer;
+};
+static thread_local const running_task_t *running_tasks = nullptr;
+
+static bool is_running_task(const ThreadPool *pool)
+{
+    for (const running_task_t *t = running_tasks; t; t = t->outer)
+    {
+        if (t->pool == pool)
+            return true;
+    }
+    return false;
+}
+
+ThreadPool::ThreadPool(size_t num_threads):
+    m_task(nullptr), m_count(0), m_next(0), m_pending(0),
+    m_generation(0), m_stop(false)
+{
+    for (size_t i = 1; i < num_threads; i++)
+    {
+        m_workers.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_all();
+
+    for (std::thread &t : m_workers)
+        t.join();
+}
+
+void ThreadPool::Run(size_t count, const std::function<void(size_t)> &task)
+{
+    if (m_workers.empty() || is_running_task(this) || count <= 1)
+    {
+        for (size_t i = 0; i < count; i++)
+            task(i);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_task = &task;
+        m_count = count;
+        m_next = 0;
+        m_pending = count;
+        m_errors.assign(count, nullptr);
+        m_generation++;
+    }
+    m_wakeup.notify_all();
+
+    RunTasks();
+
+    std::vector<std::exception_ptr> errors;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_finished.wait(lock, [this] { return m_pending == 0; });
+        m_task = nullptr;
+        m_count = 0;
+        errors.swap(m_errors);
+    }
+
+    for (const std::exception_ptr &e : errors)
+    {
+        if (e)
+            std::rethrow_exception(e);
+    }
+}
+
+size_t ThreadPool::GetDefaultThreadCount()
+{
+    size_t count = std::thread::hardware_concurrency();
+    return (count > 0) ? count : 1;
+}
+
+void ThreadPool::WorkerLoop()
+{
+    size_t generation = 0;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeup.wait(lock, [&] {
+                return m_stop || m_generation != generation;
+            });
+
+            if (m_stop)
+                return;
+
+            generation = m_generation;
+        }
+
+        RunTasks();
+    }
+}
+
+// Take task indices until none remain. Both the workers and the thread
+// inside Run() execute this.
+void ThreadPool::RunTasks()
+{
+    for (;;)
+    {
+        size_t index;
+        const std::function<void(size_t)> *task;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_next >= m_count)
+                return;
+
+            index = m_next++;
+            task = m_task;
+        }
+
+        std::exception_ptr error;
+        running_task_t running = {this, running_tasks};
+        running_tasks = &running;
+        try
+        {
+            (*task)(index);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        running_tasks = running.outer;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_errors.at(index) = error;
+            if (--m_pending == 0)
+                m_finished.notify_all();
+        }
+    }
+}
+
+}
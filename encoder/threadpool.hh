@@ -0,0 +1,105 @@
+// A small pool of worker threads for running independent tasks in parallel.
+// The pool only decides where a task runs, never what it computes: callers
+// give every task its own index and combine the results in index order, so
+// the outcome does not depend on the number of threads.
+
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace mcufont {
+
+class ThreadPool
+{
+public:
+    // Start num_threads - 1 workers; the thread calling Run() is the last
+    // one. With num_threads 0 or 1, everything runs in the calling thread.
+    explicit ThreadPool(size_t num_threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &other) = delete;
+    ThreadPool &operator=(const ThreadPool &other) = delete;
+
+    // Number of threads that execute tasks, including the caller.
+    size_t GetThreadCount() const { return m_workers.size() + 1; }
+
+    // Call task(0) ... task(count - 1) and return when all have finished.
+    // If any task throws, the exception of the lowest index is rethrown
+    // after the rest have completed. Calls from inside a task of the same
+    // pool run serially, while a task can run another pool in parallel.
+    void Run(size_t count, const std::function<void(size_t)> &task);
+
+    // Number of hardware threads, or 1 if it can't be determined.
+    static size_t GetDefaultThreadCount();
+
+private:
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::condition_variable m_finished;
+
+    // State of the current Run() call, protected by m_mutex.
+    const std::function<void(size_t)> *m_task;
+    size_t m_count;
+    size_t m_next;
+    size_t m_pending;
+    size_t m_generation;
+    bool m_stop;
+    std::vector<std::exception_ptr> m_errors;
+
+    void WorkerLoop();
+    void RunTasks();
+};
+
+}
+
+#ifdef CXXTEST_RUNNING
+#include <cxxtest/TestSuite.h>
+#include <atomic>
+#include <chrono>
+
+using namespace mcufont;
+
+class ThreadPoolTests: public CxxTest::TestSuite
+{
+public:
+    void testNestedRun()
+    {
+        // A nested call on the same pool runs in the calling thread.
+        ThreadPool pool(3);
+        std::atomic<int> sum(0);
+        pool.Run(3, [&](size_t i) {
+            pool.Run(4, [&](size_t j) { sum += (int)(i * 4 + j); });
+        });
+        TS_ASSERT_EQUALS(sum, 66);
+    }
+
+    void testNestedPools()
+    {
+        // Each task of the outer pool runs an inner pool whose two tasks
+        // wait for each other. They only meet if the inner pool really
+        // runs them at the same time.
+        ThreadPool outer(2);
+        std::vector<int> met(4, 0);
+        outer.Run(2, [&](size_t i) {
+            ThreadPool inner(2);
+            std::mutex mutex;
+            std::condition_variable arrival;
+            size_t arrived = 0;
+            inner.Run(2, [&](size_t j) {
+                std::unique_lock<std::mutex> lock(mutex);
+                arrived++;
+                arrival.notify_all();
+                met.at(i * 2 + j) = arrival.wait_for(lock, std::chrono::seconds(5),
+                    [&] { return arrived == 2; });
+            });
+        });
+        TS_ASSERT_EQUALS(met, std::vector<int>(4, 1));
+    }
+};
+#endif